@@ -0,0 +1,73 @@
+// A bot plugin: twice a second it blows itself towards the closest cloud
+// it can absorb. Build it with "make plugins" and play it with
+//   ./cloudwarsx -m timelimit -1 ai-clients/cpp/chaser.so -2 human
+
+#include "plugin.h"
+
+#include <cmath>
+#include <iostream>
+
+struct Chaser {
+	int you;
+};
+
+extern "C" void *on_start(int you) {
+	Chaser *chaser = new Chaser;
+	chaser->you = you;
+	return chaser;
+}
+
+extern "C" int on_tick(void *context, const WorldView &world, Wind *winds, int max) {
+	int me = ((Chaser *)context)->you;
+	int every = world.tickRate / 2;
+
+	if((every > 0) && (world.iteration % every != 0))
+		return 0;
+
+	// The closest cloud smaller than us, the other thunderstorm too
+	int best = -1;
+	float bestDistance = 0;
+
+	for(int i = 0; i < world.size; i++) {
+		if((i == me) || !world.alive[i] || (world.vapor[i] >= world.vapor[me]))
+			continue;
+
+		float dx = world.px[i] - world.px[me];
+		float dy = world.py[i] - world.py[me];
+		float distance = dx * dx + dy * dy;
+
+		if((best < 0) || (distance < bestDistance)) {
+			best = i;
+			bestDistance = distance;
+		}
+	}
+
+	if((best < 0) || (max < 1))
+		return 0;
+
+	float dx = world.px[best] - world.px[me];
+	float dy = world.py[best] - world.py[me];
+	float d = sqrt(dx * dx + dy * dy);
+
+	if(d < 1)
+		return 0;
+
+	// A wind of strength 10 pushes us that way, for 10 vapor
+	winds[0].x = dx / d * 10;
+	winds[0].y = dy / d * 10;
+	return 1;
+}
+
+// winner is 0 for a draw, else the player that won, 1 or 2
+extern "C" void on_end(void *context, int winner) {
+	Chaser *chaser = (Chaser *)context;
+
+	if(winner == 0)
+		std::cout << "chaser: draw" << std::endl;
+	else if(winner == chaser->you + 1)
+		std::cout << "chaser: won" << std::endl;
+	else
+		std::cout << "chaser: lost" << std::endl;
+
+	delete chaser;
+}
@@ -1,6 +1,7 @@
 #!/usr/bin/env python
 
 import socket
+import struct
 import sys
 import math
 import time
@@ -14,6 +15,10 @@ class AI:
 		else:
 			self.s = s
 
+		# 0 for the text state, 32 or 16 after binary()
+		self.format = 0
+		self.buffer = bytearray(4096)
+
 	def connect(self, host, port):
 		print "Connecting to", host, port
 		try:
@@ -24,7 +29,7 @@ class AI:
 
 	def name(self, nick):
 		print "Sending name:", nick
-		self.s.send("NAME %s" % (nick,))
+		self.s.send("NAME %s\n" % (nick,))
 
 	def start(self):
 		print "Waiting on start from server..."
@@ -36,7 +41,7 @@ class AI:
 
 	def wind(self, x, y):
 		print "Sending WIND", x, y
-		self.s.send('WIND %s %s' % (x,y))
+		self.s.send('WIND %s %s\n' % (x,y))
 		'''
 		while 1:
 			status = self.s.recv(1024)
@@ -50,11 +55,86 @@ class AI:
 				break
 		'''
 
+	def binary(self, bits=32):
+		# Ask for the binary state, 32 bit floats or 16 bit quantized
+		print "Sending BINARY", bits
+		self.s.send('BINARY %s\n' % (bits,))
+		self.format = bits
+
+	def read(self, view, n):
+		# Fill the first n bytes of view from the socket
+		got = 0
+		while got < n:
+			r = self.s.recv_into(view[got:], n - got)
+			if r == 0:
+				raise socket.error("Connection closed")
+			got += r
+
+	def getBinaryState(self):
+		print "Sending GET_STATE"
+		self.s.send('GET_STATE\n')
+
+		# Replies to earlier commands (OK, IGNORE) come before the header
+		magic = bytearray(4)
+		self.read(memoryview(magic), 4)
+		while magic != bytearray('CWST'):
+			magic = magic[1:]
+			magic.extend(self.s.recv(1))
+
+		header = bytearray(36)
+		self.read(memoryview(header), 36)
+		length, iteration, you, format, records, sx, sy, sv, svapor = struct.unpack('<5I4f', str(header))
+
+		# Reuse the buffer, the records are decoded where they landed
+		if len(self.buffer) < length - 40:
+			self.buffer = bytearray(length - 40)
+
+		self.read(memoryview(self.buffer), length - 40)
+
+		state = {}
+		state["interation"] = iteration
+		state["you"] = you
+		state["rainclouds"] = []
+		state["thunderstorms"] = []
+
+		for i in range(records):
+			if format == 32:
+				px, py, vx, vy, vapor = struct.unpack_from('<5f', self.buffer, i * 20)
+			else:
+				px, py, vx, vy, vapor = struct.unpack_from('<HHhhH', self.buffer, i * 10)
+				px, py, vx, vy, vapor = px * sx, py * sy, vx * sv, vy * sv, vapor * svapor
+
+			cloud = {"px": px, "py": py, "vx": vx, "vy": vy, "vapor": vapor}
+
+			if i < 2:
+				state["thunderstorms"].append(cloud)
+			else:
+				state["rainclouds"].append(cloud)
+
+		try:
+			state["me"] = state["thunderstorms"][state["you"]]
+			del state["thunderstorms"][state["you"]]
+		except IndexError:
+			state["me"] = "None"
+
+		self.state = state
+		return state
+
 	def getState(self):
+		if self.format:
+			return self.getBinaryState()
+
 		print "Sending GET_STATE"
-		self.s.send('GET_STATE')
+		self.s.send('GET_STATE\n')
+
+		# The state can be bigger than one recv
+		currentState = self.s.recv(4096)
+		while not currentState.endswith('END_STATE\n'):
+			data = self.s.recv(4096)
+			if not data:
+				break
+			currentState += data
 
-		currentState = self.s.recv(1024)
 		raw = currentState.split('\n')
 
 		# remove the last \n from END_STATE
@@ -101,7 +181,7 @@ class AI:
 					})
 
 		try:
-			if state.get("you", False):
+			if "you" in state:
 				state["me"] = state["thunderstorms"][state["you"]]
 				del state["thunderstorms"][state["you"]]
 			else:
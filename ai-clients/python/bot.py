@@ -1,10 +1,16 @@
 #!/usr/bin/env python
 
 import random
+import sys
 from ai import AI
 
+# The port can be given, like the tournament does
+port = 1986
+if len(sys.argv) > 1:
+	port = int(sys.argv[1])
+
 ai = AI()
-ai.connect("127.0.0.1", 1986)
+ai.connect("127.0.0.1", port)
 ai.name('oklien')
 ai.start()
 print "Game started!"
@@ -3,17 +3,44 @@
 #include <SDL/SDL_image.h>
 #include <SDL/SDL_ttf.h>
 #include <SDL/SDL_rotozoom.h> // SDL_gfx
-#include <SDL/SDL_net.h>
 #include <SDL/SDL_mixer.h>
 
 #include <iostream>
 #include <string>
 #include <sstream>
 #include <cmath>
+#include <ctime>
 #include <vector>
 #include <algorithm>
 #include <iomanip>
 #include <fstream>
+#include <list>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <getopt.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// x86-64 only: an i386 build may do the scalar math on the x87 with more
+// precision, and the kernels would no longer match it
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CLOUDWARS_X86
+#endif
+
+#include "plugin.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 // Config
@@ -28,35 +55,49 @@ bool fullscreen = false;
 bool retro = false;
 bool debug = false;
 bool nosound = false;
+bool headless = false;
+int spriteCacheSize = 32; // megabytes of scaled cloud images
 bool level = false;
+std::string levelFile; // loaded again for every game of --pool
 
-int Winner = 0;
 int timeLimit;
+int tickLimit;
 int limit;
 int defaultTimeLimit = 5;
 
+int tickRate = 100; // simulation ticks per second
+Uint32 frameRate = 60;
+const int maxTicksPerFrame = 10;
+
+std::string recordFile; // with --pool, every match gets its own file.<id>
+std::string replayFile;
+int seekTick = 0;
+const int KEYFRAME_TICKS = 1000; // a replay seeks from the last one before the tick
+
 float absorb = 1.0;
-const int MAX_CLOUDS = 50;
+const int CLOUD_CHUNK = 64; // the world grows this many slots at a time
 int startClouds = 20;
-int thunderCloud = 0;
-int rainCloud = 2;
 int vaporStart = 1000;
 
-int iteration = 0;
-bool done = false;
-
 int channel;
-int X1, Y1, X2, Y2;
-Uint32 COLOR;
 
 // Net
 int port = 1986;
 const unsigned short BUFFER_SIZE = 1024;
 const unsigned short MAX_SOCKETS = 4; // 1 server + 3 klienter
 const unsigned short MAX_CLIENTS = MAX_SOCKETS - 1;
+const int MAX_POOL_CLIENTS = 1024; // with --pool
+const int MAX_EVENTS = 64; // taken from epoll at a time
 
 int clientCount = 0;
-int playerCount = 0;
+std::atomic<int> playerCount(0);
+
+int wakeFd = -1; // eventfd the server thread sleeps on, see wakeServer()
+std::atomic<int> subscribers(0); // clients with SUBSCRIBE, set by the server
+
+int poolSize = 0; // worker threads with --pool, 0 plays the one game of the window
+bool tournament = false; // --tournament, the pool plays the bots of a file
+std::string resultsFile = "results.csv";
 
 ////////////////////////////////////////////////////////////////////////////////
 // Objects
@@ -83,12 +124,196 @@ SDL_Color textColor = {255, 255, 255};
 SDL_Surface *winner = NULL;
 
 SDL_Thread *thread = NULL;
+SDL_Thread *simThread = NULL;
 
 enum gamemodes { 
 	deathmatch,
 	timelimit
 };
 
+gamemodes gamemode;
+
+////////////////////////////////////////////////////////////////////////////////
+// Clock
+////////////////////////////////////////////////////////////////////////////////
+
+// Nanoseconds from an arbitrary start, for timing. SDL_GetTicks() only has
+// milliseconds.
+Uint64 nanoTime() {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (Uint64)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Profiler
+////////////////////////////////////////////////////////////////////////////////
+
+bool profiling = false; // -d or --profile, the timers cost nothing without
+
+enum phases {
+	eventsPhase,
+	drawingPhase,
+	flipPhase,
+	integratePhase,
+	collisionPhase,
+	sweepPhase,
+	serverPhase,
+	PHASES
+};
+
+const char *phaseNames[] = {"events", "drawing", "flip", "integrate", "collision", "sweep", "server"};
+
+const int PROFILE_SAMPLES = 256; // the overlay shows the last this many
+const int PROFILE_BUCKETS = 4 * 32; // four a power of two of nanoseconds
+
+// The times of one phase: the latest in a ring for the overlay, and all of
+// them in a histogram for the summary at exit. Pool workers time their
+// matches at once, so adding one takes no lock.
+class Phase {
+	public:
+		Phase();
+		void add(Uint32 ns);
+		void recent(Uint32 &min, Uint32 &avg, Uint32 &p99) const;
+		Uint32 percentile(double p) const;
+
+		std::atomic<Uint64> count;
+		std::atomic<Uint64> total;
+		std::atomic<Uint32> maximum;
+
+	private:
+		std::atomic<Uint32> ring[PROFILE_SAMPLES];
+		std::atomic<unsigned int> next;
+		std::atomic<Uint64> buckets[PROFILE_BUCKETS];
+};
+
+Phase phase[PHASES];
+
+Phase::Phase() {
+	count = 0;
+	total = 0;
+	maximum = 0;
+	next = 0;
+
+	for(int i = 0; i < PROFILE_SAMPLES; i++)
+		ring[i] = 0;
+
+	for(int i = 0; i < PROFILE_BUCKETS; i++)
+		buckets[i] = 0;
+}
+
+// The highest bit and the two below it, so a bucket is at most 19% wide
+int profileBucket(Uint32 ns) {
+	if(ns < 4)
+		return ns;
+
+	int high = 31 - __builtin_clz(ns);
+	return high * 4 + ((ns >> (high - 2)) & 3);
+}
+
+// The biggest time in the bucket
+Uint32 bucketLimit(int bucket) {
+	if(bucket < 4)
+		return bucket;
+
+	int high = bucket / 4;
+	return (Uint32)(((Uint64)(4 + bucket % 4 + 1) << (high - 2)) - 1);
+}
+
+void Phase::add(Uint32 ns) {
+	ring[next.fetch_add(1, std::memory_order_relaxed) % PROFILE_SAMPLES].store(ns, std::memory_order_relaxed);
+	buckets[profileBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	total.fetch_add(ns, std::memory_order_relaxed);
+
+	Uint32 seen = maximum.load(std::memory_order_relaxed);
+	while((ns > seen) && !maximum.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+		;
+}
+
+// Over the ring, for the overlay
+void Phase::recent(Uint32 &min, Uint32 &avg, Uint32 &p99) const {
+	int n = std::min((unsigned int)PROFILE_SAMPLES, next.load(std::memory_order_relaxed));
+	Uint32 samples[PROFILE_SAMPLES];
+	Uint64 sum = 0;
+
+	for(int i = 0; i < n; i++) {
+		samples[i] = ring[i].load(std::memory_order_relaxed);
+		sum += samples[i];
+	}
+
+	if(n == 0) {
+		min = avg = p99 = 0;
+		return;
+	}
+
+	std::nth_element(samples, samples + n * 99 / 100, samples + n);
+	p99 = samples[n * 99 / 100];
+	min = *std::min_element(samples, samples + n);
+	avg = sum / n;
+}
+
+// Over every sample, from the histogram, so only up to the bucket width
+Uint32 Phase::percentile(double p) const {
+	Uint64 rank = count * p;
+	Uint64 seen = 0;
+
+	for(int i = 0; i < PROFILE_BUCKETS; i++) {
+		seen += buckets[i].load(std::memory_order_relaxed);
+
+		if(seen > rank)
+			return std::min(bucketLimit(i), maximum.load());
+	}
+
+	return maximum;
+}
+
+// Times the block it is declared in as a phase
+class ScopedTimer {
+	public:
+		ScopedTimer(phases p);
+		~ScopedTimer();
+
+	private:
+		phases timed;
+		Uint64 start;
+};
+
+ScopedTimer::ScopedTimer(phases p) {
+	timed = p;
+	start = profiling ? nanoTime() : 0;
+}
+
+ScopedTimer::~ScopedTimer() {
+	if(profiling)
+		phase[timed].add(nanoTime() - start);
+}
+
+// Where the time went, at exit
+void profileSummary() {
+	if(!profiling)
+		return;
+
+	std::streamsize precision = std::cout.precision();
+	std::cout << "Phase\t\tcount\tavg us\tp99 us\tmax us" << std::endl;
+
+	for(int p = 0; p < PHASES; p++) {
+		Uint64 count = phase[p].count;
+
+		if(count == 0)
+			continue;
+
+		std::cout << std::setw(16) << std::left << phaseNames[p] << std::right << count << "\t"
+			<< std::fixed << std::setprecision(1)
+			<< phase[p].total / 1000.0 / count << "\t"
+			<< phase[p].percentile(0.99) / 1000.0 << "\t"
+			<< phase[p].maximum / 1000.0 << std::endl;
+	}
+
+	std::cout.unsetf(std::ios::fixed);
+	std::cout.precision(precision);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Split string function
 ////////////////////////////////////////////////////////////////////////////////
@@ -106,13 +331,184 @@ void split(const std::string& s, char c, std::vector<std::string>& v) {
 	}
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Number formatting
+////////////////////////////////////////////////////////////////////////////////
+
+// These write into a caller's buffer and return the new end of the text,
+// without streams, locales or allocations. The text is zero terminated.
+
+char *formatInt(char *out, long long value) {
+	char digits[24];
+	int n = 0;
+	unsigned long long v = value < 0 ? -(unsigned long long)value : value;
+
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while(v);
+
+	if(value < 0)
+		*out++ = '-';
+
+	while(n)
+		*out++ = digits[--n];
+
+	*out = '\0';
+	return out;
+}
+
+// Fixed point with the given number of decimals, like std::fixed
+char *formatFixed(char *out, double value, int decimals) {
+	long long scale = 1;
+	for(int i = 0; i < decimals; i++)
+		scale *= 10;
+
+	if(value != value || fabs(value) > 1e15) {
+		strcpy(out, value != value ? "nan" : (value < 0 ? "-inf" : "inf"));
+		return out + strlen(out);
+	}
+
+	if(value < 0) {
+		*out++ = '-';
+		value = -value;
+	}
+
+	long long n = value * scale + 0.5;
+	out = formatInt(out, n / scale);
+
+	if(decimals > 0) {
+		*out++ = '.';
+
+		for(long long div = scale / 10; div > 0; div /= 10)
+			*out++ = '0' + (n / div) % 10;
+
+		*out = '\0';
+	}
+
+	return out;
+}
+
+// Same text as std::ostream << float, that is %g with 6 significant digits.
+// Floats between 0.0001 and 1000000 are scaled to 6 digits exactly in a
+// double and rounded like printf does. Anything else goes to snprintf.
+char *formatFloat(char *out, float value) {
+	static const double power[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+	double v = fabs(value);
+
+	if(v == 0) {
+		strcpy(out, std::signbit(value) ? "-0" : "0");
+		return out + strlen(out);
+	}
+
+	if(!(v >= 1e-4 && v < 1e6))
+		return out + sprintf(out, "%g", value);
+
+	// Decimal exponent of the first digit. A float times these powers is
+	// exact in a double, so the comparison and the rounding are too.
+	int exponent = 5;
+	while(v * power[5 - exponent] < 100000)
+		--exponent;
+
+	long digits = rint(v * power[5 - exponent]);
+
+	// Rounded up to the next power of ten
+	if(digits == 1000000) {
+		digits = 100000;
+		++exponent;
+	}
+
+	if(exponent >= 6 || digits < 100000 || digits > 999999)
+		return out + sprintf(out, "%g", value);
+
+	char d[6];
+	for(int i = 5; i >= 0; i--) {
+		d[i] = '0' + digits % 10;
+		digits /= 10;
+	}
+
+	// Trailing zeros are not printed
+	int last = 5;
+	while(last > 0 && d[last] == '0')
+		--last;
+
+	if(value < 0)
+		*out++ = '-';
+
+	if(exponent >= 0) {
+		for(int i = 0; i <= exponent; i++)
+			*out++ = d[i];
+
+		if(last > exponent) {
+			*out++ = '.';
+
+			for(int i = exponent + 1; i <= last; i++)
+				*out++ = d[i];
+		}
+	} else {
+		*out++ = '0';
+		*out++ = '.';
+
+		for(int i = -1; i > exponent; i--)
+			*out++ = '0';
+
+		for(int i = 0; i <= last; i++)
+			*out++ = d[i];
+	}
+
+	*out = '\0';
+	return out;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Dirty rectangles
+////////////////////////////////////////////////////////////////////////////////
+
+// While tracking, every area drawn on the screen is remembered, so the next
+// frame only has to restore and update those areas instead of the whole screen.
+bool trackDirty = false;
+std::vector<SDL_Rect> dirtyRects;
+
+void markDirty(int x, int y, int w, int h) {
+	if(!trackDirty)
+		return;
+
+	// Clip to the screen
+	if(x < 0) {
+		w += x;
+		x = 0;
+	}
+
+	if(y < 0) {
+		h += y;
+		y = 0;
+	}
+
+	if(x + w > screen->w)
+		w = screen->w - x;
+
+	if(y + h > screen->h)
+		h = screen->h - y;
+
+	if((w <= 0) || (h <= 0))
+		return;
+
+	SDL_Rect r;
+	r.x = x;
+	r.y = y;
+	r.w = w;
+	r.h = h;
+
+	dirtyRects.push_back(r);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Draw functions
 ////////////////////////////////////////////////////////////////////////////////
 
 // only 32-bit pixels
 void setPixel(SDL_Surface *surface, int x, int y, Uint32 pixel) {
-	if((x > width) || (x < 0) || (y < 0) || (y > height)) {
+	if((x >= surface->w) || (x < 0) || (y < 0) || (y >= surface->h)) {
 		//std::cout << "hit: " << x << " " << y << std::endl;
 	} else {
 		Uint8 *target_pixel = (Uint8 *)surface->pixels + y * surface->pitch + x * 4;
@@ -185,6 +581,10 @@ void drawSurface(int x, int y, SDL_Surface* source, SDL_Surface* destination) {
 	offset.y = y;
 
 	SDL_BlitSurface(source, NULL, destination, &offset);
+
+	// The blit leaves the clipped area in offset
+	if(destination == screen)
+		markDirty(offset.x, offset.y, offset.w, offset.h);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -206,7 +606,54 @@ SDL_Surface *loadImage(std::string filename) {
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Cloud Class
+// Random numbers
+////////////////////////////////////////////////////////////////////////////////
+
+// xorshift32. Every match rolls its own numbers instead of using rand(), so
+// the same seed and commands play the same match again, see Replay.
+class Random {
+	public:
+		Random();
+		void seed(Uint32 s);
+		Uint32 next();
+		int below(int n);
+		int range(int x);
+
+		Uint32 state;
+};
+
+Random::Random() {
+	seed(1);
+}
+
+void Random::seed(Uint32 s) {
+	// xorshift never leaves 0
+	state = s ? s : 0x9e3779b9;
+}
+
+Uint32 Random::next() {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+// 0 to n-1
+int Random::below(int n) {
+	return next() % n;
+}
+
+// -x to x but never 0
+int Random::range(int x) {
+	int random = 0;
+	while(random == 0) {
+		random = below(x+x+1) - x;
+	}
+	return random;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// World
 ////////////////////////////////////////////////////////////////////////////////
 
 enum types {
@@ -215,596 +662,4249 @@ enum types {
 	raincloud,
 };
 
-class Cloud {
+// The simulation state of every cloud, one array per property so the physics
+// loops run over contiguous memory. Cloud i is index i in every array, slot 0
+// and 1 are the thunderstorms. Nothing here knows about SDL.
+//
+// Raincloud slots are pooled: dead slots go on a free-list and are reused
+// before the arrays grow, and the arrays grow CLOUD_CHUNK slots at a time.
+// Slots are never given back, so memory stays flat over a match.
+class World {
 	public:
-		Cloud(float pX, float pY, float vX, float vY, float V);
-		~Cloud();
-		void draw();
-		void show();
-		void drawName();
-		void drawVapor();
-		void drawVelocity();
-		void drawPosition();
-
-	//private:
-		int player;
-		float px, py; // The point (px,py) is the position of the cloud
-		float vx, vy; // The vector [vx,vy] is the velocity of the cloud
-		float vapor; // The amount of vapor in the cloud
-		float radius() { return sqrt(vapor);} // radius is square root of vapor
-
-		bool alive;
-		std::string name;
-		std::string color;
-		SDL_Surface *cloudImage;
-		SDL_Surface *playerName;
-		SDL_Surface *vaporAmount;
-		SDL_Surface *velocityX;
-		SDL_Surface *velocityY;
-		SDL_Surface *positionX;
-		SDL_Surface *positionY;
-
-		types type;
+		World();
+		int size() const { return alive.size(); }
+		void spawn(int i, types t, float pX, float pY, float vX, float vY, float V);
+		int add(types t, float pX, float pY, float vX, float vY, float V);
+		void kill(int i);
+		void addVapor(int i, float V);
+		void grow();
+		void save(std::string &out) const;
+		const char *load(const char *in, const char *end);
+		size_t flatSize() const;
+		char *copyOut(char *out) const;
+		const char *copyIn(const char *in);
+
+		std::vector<float> px, py; // The point (px,py) is the position of the cloud
+		std::vector<float> ppx, ppy; // Position at the previous tick
+		std::vector<float> vx, vy; // The vector [vx,vy] is the velocity of the cloud
+		std::vector<float> vapor; // The amount of vapor in the cloud
+		std::vector<float> radius; // radius is square root of vapor, kept in sync by addVapor()
+		std::vector<types> type;
+		std::vector<unsigned char> alive;
+		std::vector<unsigned char> bounced; // hit a wall during the last tick
+
+	private:
+		std::vector<int> freeSlots; // dead raincloud slots, used from the back
 };
 
-Cloud::Cloud(float pX, float pY, float vX, float vY, float V) {
-	px = pX;
-	py = pY;
-	vx = vX;
-	vy = vY;
-	vapor = V;
-	cloudImage = NULL;
-	playerName = NULL;
-	vaporAmount = NULL;
-	velocityX = NULL;
-	velocityY = NULL;
-	positionX = NULL;
-	positionY = NULL;
-}
-
-Cloud::~Cloud() {
-	SDL_FreeSurface(cloudImage);
-	SDL_FreeSurface(playerName);
-	SDL_FreeSurface(vaporAmount);
-	SDL_FreeSurface(velocityX);
-	SDL_FreeSurface(velocityY);
-	SDL_FreeSurface(positionX);
-	SDL_FreeSurface(positionY);
-
-}
-void Cloud::draw() {
-	Uint32 color;
-
-	if(player == 1)
-		color = 0x000000FF; // blue
-	else if(player == 2)
-		color = 0x00FF0000; // red
-
-	if(type == raincloud)
-		color = 0x007F7F7F; // gray
+World::World() {
+	grow();
+}
 
-	drawCircle(screen, px, py, radius(), color);
+// Add CLOUD_CHUNK dead slots. The first chunk also holds the thunderstorms,
+// which are never on the free-list.
+void World::grow() {
+	int first = size();
+	int last = first + CLOUD_CHUNK;
+
+	px.resize(last);
+	py.resize(last);
+	ppx.resize(last);
+	ppy.resize(last);
+	vx.resize(last);
+	vy.resize(last);
+	vapor.resize(last);
+	radius.resize(last);
+	type.resize(last, raincloud);
+	alive.resize(last, false);
+	bounced.resize(last, false);
+
+	// Lowest slot ends up at the back, so it is used first
+	for(int i = last - 1; i >= std::max(first, 2); i--)
+		freeSlots.push_back(i);
 }
 
-void Cloud::drawName() {
-	playerName = TTF_RenderText_Solid(font, name.c_str(), textColor);
-	drawSurface(px - name.length() * 2, py + radius() + 5, playerName, screen);
+// Put a thunderstorm in slot 0 or 1, rainclouds go through add()
+void World::spawn(int i, types t, float pX, float pY, float vX, float vY, float V) {
+	px[i] = ppx[i] = pX;
+	py[i] = ppy[i] = pY;
+	vx[i] = vX;
+	vy[i] = vY;
+	vapor[i] = V;
+	radius[i] = sqrt(V);
+	type[i] = t;
+	alive[i] = true;
 }
 
-void Cloud::drawVapor() {
-	std::stringstream vss;
-	vss << std::fixed << std::setprecision(2) << vapor;
-	std::string vs = vss.str();
+// Put a cloud in a free raincloud slot and return the slot
+int World::add(types t, float pX, float pY, float vX, float vY, float V) {
+	if(freeSlots.empty())
+		grow();
 
-	vaporAmount = TTF_RenderText_Solid(font, vs.c_str(), textColor);
-	drawSurface(px - vs.length() * 2, py - radius() - 10, vaporAmount, screen);
+	int i = freeSlots.back();
+	freeSlots.pop_back();
+
+	spawn(i, t, pX, pY, vX, vY, V);
+	return i;
 }
 
-void Cloud::drawVelocity() {
-	std::stringstream vxss;
-	vxss << "vx: " << std::fixed << std::setprecision(2) << vx; // to desimaler
-	std::string vxs = vxss.str();
+void World::kill(int i) {
+	if(!alive[i])
+		return;
+
+	alive[i] = false;
 
-	std::stringstream vyss;
-	vyss << "vy: " << std::fixed << std::setprecision(2) << vy; // to desimaler
-	std::string vys = vyss.str();
+	if(i >= 2)
+		freeSlots.push_back(i);
+}
 
-	velocityX = TTF_RenderText_Solid(font, vxs.c_str(), textColor);
-	drawSurface(px + radius() + 10, py - 5, velocityX, screen);
+void World::addVapor(int i, float V) {
+	vapor[i] += V;
+	radius[i] = sqrt(vapor[i]);
+}
 
-	velocityY = TTF_RenderText_Solid(font, vys.c_str(), textColor);
-	drawSurface(px + radius() + 10, py + 5, velocityY, screen);
+template<class T> char *copyArray(char *out, const std::vector<T> &v) {
+	memcpy(out, v.data(), v.size() * sizeof(T));
+	return out + v.size() * sizeof(T);
 }
 
-void Cloud::drawPosition() {
-	std::stringstream pxss;
-	pxss << "px: " << (int)px;
-	std::string pxs = pxss.str();
+template<class T> const char *copyArray(std::vector<T> &v, int n, const char *in) {
+	v.resize(n);
+	memcpy(v.data(), in, n * sizeof(T));
+	return in + n * sizeof(T);
+}
 
-	std::stringstream pyss;
-	pyss << "py: " << (int)py;
-	std::string pys = pyss.str();
+// Bytes copyOut() writes
+size_t World::flatSize() const {
+	return 2 * sizeof(int) + size() * (8 * sizeof(float) + sizeof(types) + 2) + freeSlots.size() * sizeof(int);
+}
 
-	positionX = TTF_RenderText_Solid(font, pxs.c_str(), textColor);
-	drawSurface(px - radius() - 10 - pxs.length() * 6, py - 5, positionX, screen);
+// The slot count, the free-list length and then every array as it is in
+// memory, for a State
+char *World::copyOut(char *out) const {
+	int counts[2] = {size(), (int)freeSlots.size()};
+	memcpy(out, counts, sizeof(counts));
+	out += sizeof(counts);
+
+	out = copyArray(out, px);
+	out = copyArray(out, py);
+	out = copyArray(out, ppx);
+	out = copyArray(out, ppy);
+	out = copyArray(out, vx);
+	out = copyArray(out, vy);
+	out = copyArray(out, vapor);
+	out = copyArray(out, radius);
+	out = copyArray(out, type);
+	out = copyArray(out, freeSlots);
+	out = copyArray(out, alive);
+	out = copyArray(out, bounced);
+
+	return out;
+}
 
-	positionY = TTF_RenderText_Solid(font, pys.c_str(), textColor);
-	drawSurface(px - radius() - 10 - pxs.length() * 6, py + 5, positionY, screen);
+// Back to what copyOut() wrote. Same sizes as before do not allocate.
+const char *World::copyIn(const char *in) {
+	int counts[2];
+	memcpy(counts, in, sizeof(counts));
+	in += sizeof(counts);
+
+	int slots = counts[0];
+
+	in = copyArray(px, slots, in);
+	in = copyArray(py, slots, in);
+	in = copyArray(ppx, slots, in);
+	in = copyArray(ppy, slots, in);
+	in = copyArray(vx, slots, in);
+	in = copyArray(vy, slots, in);
+	in = copyArray(vapor, slots, in);
+	in = copyArray(radius, slots, in);
+	in = copyArray(type, slots, in);
+	in = copyArray(freeSlots, counts[1], in);
+	in = copyArray(alive, slots, in);
+	in = copyArray(bounced, slots, in);
+
+	return in;
 }
 
-void Cloud::show() {
-	double diamenter = radius() * 2.6; // .6 pga skyene ikke fyller hele bildet!
-	double zoomx = diamenter  / (float)gray->w;
-	double zoomy = diamenter / (float)gray->h;
+////////////////////////////////////////////////////////////////////////////////
+// Saved states
+////////////////////////////////////////////////////////////////////////////////
 
-	if(color == "gray")
-		cloudImage = zoomSurface(gray, zoomx, zoomy, SMOOTHING_OFF);
-	else if(color == "blue")
-		cloudImage = zoomSurface(blue, zoomx, zoomy, SMOOTHING_OFF);
-	else if(color == "red")
-		cloudImage = zoomSurface(red, zoomx, zoomy, SMOOTHING_OFF);
+// Everything a match simulates from in one flat buffer of plain data: a
+// header and then the world arrays back to back. Match::capture() makes one
+// and Match::restore() puts it back, a memcpy per array either way.
+//
+// A State is never changed once captured, so copies share the buffer and a
+// fork is just a copy. A branch writes by restoring into a match, ticking it
+// and capturing a State of its own, the one it came from stays as it was.
+class State {
+	public:
+		bool empty() const { return !buffer; }
+		size_t size() const { return buffer ? buffer->size() : 0; }
 
-	drawSurface(px - diamenter / 2, py - diamenter / 2, cloudImage, screen);
-}
+	private:
+		friend class Match;
 
-Cloud *cloud[MAX_CLOUDS];
+		struct Header {
+			int iteration;
+			int bounces;
+			int winner;
+			Uint32 random;
+			int done;
+		};
 
+		std::shared_ptr<const std::vector<char> > buffer;
+};
 
 ////////////////////////////////////////////////////////////////////////////////
-// Usage
+// Snapshots
 ////////////////////////////////////////////////////////////////////////////////
 
-void usage() {
-	std::cout << "Usage: ./cloudwarsx -m [deathmatch, timelimit] -1 [ai, human] -2 [ai, human]" << std::endl;
-	std::cout << "\t-m gamemode\tdeathmatch / timelimit" << std::endl;
-	std::cout << "\t-s seconds\ttime limit in seconds" << std::endl;
-	std::cout << "\t-1 ai / human\tplayer 1" << std::endl;
-	std::cout << "\t-2 ai / human\tplayer 2" << std::endl;
-	std::cout << "\t-l filename\tlevel filename" << std::endl;
-	std::cout << "\t-r\t\tenable retromode (no gfx)" << std::endl;
-	std::cout << "\t-x width\tset width" << std::endl;
-	std::cout << "\t-y height\tset height" << std::endl;
-	std::cout << "\t-f\t\tenable fullscreen" << std::endl;
-	std::cout << "\t-p port\t\ttcp port for server" << std::endl;
-	std::cout << "\t-n\t\tno sound" << std::endl;
-	std::cout << "\t-d\t\tdebug mode" << std::endl;
-	std::cout << "\t-v\t\tshow the version" << std::endl;
-	exit(1);
+// A copy of the world after a tick. It is never changed while someone reads
+// it, so the renderer and the server can use it while the simulation runs.
+class Snapshot {
+	public:
+		Snapshot();
+		void copy(const World &w);
+
+		int size;
+		int iteration;
+		Uint32 time; // when it was published, for interpolation
+		int bounces;
+		int X1, Y1, X2, Y2; // debug wind line
+		Uint32 color;
+		std::string name[2];
+
+		std::vector<float> px, py, ppx, ppy, vx, vy, vapor, radius;
+		std::vector<types> type;
+		std::vector<unsigned char> alive;
+
+		std::atomic<int> readers;
+};
+
+Snapshot::Snapshot() {
+	size = 0;
+	iteration = 0;
+	time = 0;
+	bounces = 0;
+	X1 = Y1 = X2 = Y2 = 0;
+	color = 0;
+	readers = 0;
 }
 
-//Return the distance between the two points
-double distance(int x1, int y1, int x2, int y2) {
-	return sqrt(pow( x2 - x1, 2) + pow(y2 - y1, 2));
+void Snapshot::copy(const World &w) {
+	size = w.size();
+
+	// Same sizes as last time, so no allocations once the world stops growing
+	px.assign(w.px.begin(), w.px.begin() + size);
+	py.assign(w.py.begin(), w.py.begin() + size);
+	ppx.assign(w.ppx.begin(), w.ppx.begin() + size);
+	ppy.assign(w.ppy.begin(), w.ppy.begin() + size);
+	vx.assign(w.vx.begin(), w.vx.begin() + size);
+	vy.assign(w.vy.begin(), w.vy.begin() + size);
+	vapor.assign(w.vapor.begin(), w.vapor.begin() + size);
+	radius.assign(w.radius.begin(), w.radius.begin() + size);
+	type.assign(w.type.begin(), w.type.begin() + size);
+	alive.assign(w.alive.begin(), w.alive.begin() + size);
 }
 
-bool checkCollision(Cloud &A, Cloud &B) {
-	//If the distance between the centers of the circles is less than the sum of their radii
-	if(distance(A.px, A.py, B.px, B.py) < (A.radius() + B.radius())) {
-		//The circles have collided
-		return true;
-	}
+// The simulation writes a slot nobody reads and then makes it the latest.
+// Readers take the latest and count themselves in, so it is not reused under
+// them. With two readers (renderer and server) and the latest, one of the four
+// slots is always free.
+class SnapshotBuffer {
+	public:
+		SnapshotBuffer();
+		Snapshot *write();
+		void publish(Snapshot *s);
+		const Snapshot *acquire();
+		void release(const Snapshot *s);
 
-	//If not
-	return false;
+	private:
+		static const int SLOTS = 4;
+
+		Snapshot slot[SLOTS];
+		std::atomic<int> latest;
+};
+
+SnapshotBuffer::SnapshotBuffer() {
+	latest = 0;
 }
 
-int wind(int player, int x, int y) {
+// Only ever called by one thread at a time
+Snapshot *SnapshotBuffer::write() {
+	for(;;) {
+		for(int i = 0; i < SLOTS; i++) {
+			if((i != latest) && (slot[i].readers == 0))
+				return &slot[i];
+		}
 
-	// draw line
-	if(debug) {
-		X1 = cloud[player]->px;
-		Y1 = cloud[player]->py;
-		X2 = x+X1;
-		Y2 = y+Y1;
+		// A reader is between looking and counting itself in, it backs off
+		SDL_Delay(0);
 	}
+}
 
-	// The strength of the wind is calculated as sqrt(x*x+y*y).
-	float strength = sqrt(x * x + y * y);
-
-	// This value is not allowed to be less than 1.0 or greater than vapor/2.
-	// If this happens, the WIND command is ignored.
-	if((strength < 1.0) || (strength > cloud[player]->vapor / 2)) {
-		if(debug)
-			COLOR = 0x00FF0000; // red
-		return 1; // IGNORE
+void SnapshotBuffer::publish(Snapshot *s) {
+	latest = s - slot;
+}
 
-	} else {
-		// The vapor property of the thunderstorm will be reduced by strength.
-		cloud[player]->vapor -= strength;
+const Snapshot *SnapshotBuffer::acquire() {
+	for(;;) {
+		int i = latest;
+		slot[i].readers++;
 
-		// If the thunderstorm's amount of vapor goes below 1.0, the player dies
-		// and is removed from the player list. The player's client can be
-		// immediately disconnected with no prior warning.
-		if(cloud[player]->vapor <= 1.0) {
-			std::cout << "Vapor amount to low. Die!" << std::endl;
-		}
+		// Still the latest, so write() can not have picked it
+		if(i == latest)
+			return &slot[i];
 
-		// The vector [(x / radius)*5, (y / radius)*5] is added to the velocity
-		// of the thunderstorm.
-		cloud[player]->vx += (x / cloud[player]->radius()) * 5;
-		cloud[player]->vy += (y / cloud[player]->radius()) * 5;
+		slot[i].readers--;
+	}
+}
 
-		// The vector [wx, wy] is calculated as [x / strength, y / strength].
-		float wx = x / strength;
-		float wy = y / strength;
+void SnapshotBuffer::release(const Snapshot *s) {
+	slot[s - slot].readers--;
+}
 
-		// Let vector [vx, vy] represent the velocity of the thunderstorm.
-		int vx = cloud[player]->vx;
-		int vy = cloud[player]->vy;
+// Tell the server thread there is a new tick or the game is done
+void wakeServer() {
+	if(wakeFd >= 0 && eventfd_write(wakeFd, 1) < 0)
+		std::cout << "Could not wake the server: " << strerror(errno) << std::endl;
+}
 
-		// A new raincloud is spawned with vapor equal to strength
-		float raincloud_radius = sqrt(strength);
+////////////////////////////////////////////////////////////////////////////////
+// Motion
+////////////////////////////////////////////////////////////////////////////////
 
-		// The distance to spawn the new raincloud at is calculated as:
-		// (int)((storm_radius + raincloud_radius) * 1.1)
-		int distance = (cloud[player]->radius() + raincloud_radius) * 1.1;
+// Every tick each cloud is damped, moved and bounced off the walls:
+//   v *= 0.999, p += v * 0.1, and on a wall p is clamped and v = |v| * 0.6
+// pointing away from it. The kernels below do exactly the same float math on
+// the world arrays, 1, 4 or 8 clouds at a time, so they give identical results.
+// Dead slots are moved too (it is cheaper than skipping them), they just never
+// report a bounce.
+
+const float damping = 0.999;
+const float step = 0.1;
+const float bounce = 0.6;
+
+void integrateScalar(World &w, int first, int last) {
+	for(int i = first; i < last; i++) {
+		float r = w.radius[i];
+		bool collision = false;
+
+		// Remember where we were, the renderer interpolates from here
+		w.ppx[i] = w.px[i];
+		w.ppy[i] = w.py[i];
+
+		// The velocity is damped to make it more natural.
+		w.vx[i] *= damping;
+		w.vy[i] *= damping;
+
+		// position += velcoity * 0.1
+		w.px[i] += w.vx[i] * step; // left or right
+		w.py[i] += w.vy[i] * step; //  up or down
+
+		// Collision Left
+		if(w.px[i] < r) {
+			w.px[i] = r;
+			w.vx[i] = fabsf(w.vx[i]) * bounce;
+			collision = true;
+		}
 
-		// The position of the new raincloud is set to
-		// [(int)(px - wx * distance), (int)(py - wy * distance)]
-		int cpx = cloud[player]->px - wx * distance;
-		int cpy = cloud[player]->py - wy * distance;
+		// Collision Top
+		if(w.py[i] < r) {
+			w.py[i] = r;
+			w.vy[i] = fabsf(w.vy[i]) * bounce;
+			collision = true;
+		}
 
-		// with velocity
-		// [-(x / strength)*20 + vx, -(y / strength)*20 + vy]
-		float cvx = -(x / strength) * 20 + vx;
-		float cvy = -(y / strength) * 20 + vy;
+		// Collision Right
+		if(w.px[i] + r > width) {
+			w.px[i] = width - r;
+			w.vx[i] = -fabsf(w.vx[i]) * bounce;
+			collision = true;
+		}
 
-		for(int i = 0; i < MAX_CLOUDS; i++) {
-			if(!cloud[i]->alive) {
-				cloud[i] = new Cloud(cpx, cpy, cvx, cvy, strength);
-				cloud[i]->alive = true;
-				cloud[i]->type = raincloud;
-				cloud[i]->color = "gray";
-				break;
-			}
+		// Collision Bottom
+		if(w.py[i] + r > height) {
+			w.py[i] = height - r;
+			w.vy[i] = -fabsf(w.vy[i]) * bounce;
+			collision = true;
 		}
 
-		if(debug)
-			COLOR = 0x0000FF00;
+		w.bounced[i] = collision && w.alive[i];
+	}
+}
 
-		return 0; // OK
+#ifdef CLOUDWARS_X86
+__attribute__((target("sse2")))
+void integrateSSE2(World &w, int n) {
+	const __m128 damp = _mm_set1_ps(damping);
+	const __m128 dt = _mm_set1_ps(step);
+	const __m128 bnc = _mm_set1_ps(bounce);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 right = _mm_set1_ps((float)width);
+	const __m128 bottom = _mm_set1_ps((float)height);
+
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m128 r = _mm_loadu_ps(&w.radius[i]);
+		__m128 px = _mm_loadu_ps(&w.px[i]);
+		__m128 py = _mm_loadu_ps(&w.py[i]);
+		__m128 vx = _mm_mul_ps(_mm_loadu_ps(&w.vx[i]), damp);
+		__m128 vy = _mm_mul_ps(_mm_loadu_ps(&w.vy[i]), damp);
+
+		_mm_storeu_ps(&w.ppx[i], px);
+		_mm_storeu_ps(&w.ppy[i], py);
+
+		px = _mm_add_ps(px, _mm_mul_ps(vx, dt));
+		py = _mm_add_ps(py, _mm_mul_ps(vy, dt));
+
+		// Walls in the same order as the scalar code, each one a masked select
+		__m128 left = _mm_cmplt_ps(px, r);
+		px = _mm_or_ps(_mm_and_ps(left, r), _mm_andnot_ps(left, px));
+		vx = _mm_or_ps(_mm_and_ps(left, _mm_mul_ps(_mm_andnot_ps(sign, vx), bnc)), _mm_andnot_ps(left, vx));
+
+		__m128 top = _mm_cmplt_ps(py, r);
+		py = _mm_or_ps(_mm_and_ps(top, r), _mm_andnot_ps(top, py));
+		vy = _mm_or_ps(_mm_and_ps(top, _mm_mul_ps(_mm_andnot_ps(sign, vy), bnc)), _mm_andnot_ps(top, vy));
+
+		__m128 rgt = _mm_cmpgt_ps(_mm_add_ps(px, r), right);
+		px = _mm_or_ps(_mm_and_ps(rgt, _mm_sub_ps(right, r)), _mm_andnot_ps(rgt, px));
+		vx = _mm_or_ps(_mm_and_ps(rgt, _mm_mul_ps(_mm_or_ps(sign, vx), bnc)), _mm_andnot_ps(rgt, vx));
+
+		__m128 bot = _mm_cmpgt_ps(_mm_add_ps(py, r), bottom);
+		py = _mm_or_ps(_mm_and_ps(bot, _mm_sub_ps(bottom, r)), _mm_andnot_ps(bot, py));
+		vy = _mm_or_ps(_mm_and_ps(bot, _mm_mul_ps(_mm_or_ps(sign, vy), bnc)), _mm_andnot_ps(bot, vy));
+
+		_mm_storeu_ps(&w.px[i], px);
+		_mm_storeu_ps(&w.py[i], py);
+		_mm_storeu_ps(&w.vx[i], vx);
+		_mm_storeu_ps(&w.vy[i], vy);
+
+		int hit = _mm_movemask_ps(_mm_or_ps(_mm_or_ps(left, top), _mm_or_ps(rgt, bot)));
+		for(int k = 0; k < 4; k++)
+			w.bounced[i+k] = ((hit >> k) & 1) && w.alive[i+k];
 	}
+
+	integrateScalar(w, i, n);
 }
 
-void wind(int player, std::string way) {
-	if(way == "up") {
-		cloud[player]->vapor -= absorb;
-		cloud[player]->vy -= 1;
-
-		for(int i = 0; i < MAX_CLOUDS; i++) {
-			if(!cloud[i]->alive) {
-				cloud[i] = new Cloud(cloud[player]->px, cloud[player]->py + cloud[player]->radius() + absorb, -cloud[player]->vx, -cloud[player]->vy, absorb);
-				cloud[i]->alive = true;
-				cloud[i]->type = raincloud;
-				cloud[i]->color = "gray";
-				break;
-			}
-		}
+__attribute__((target("avx2")))
+void integrateAVX2(World &w, int n) {
+	const __m256 damp = _mm256_set1_ps(damping);
+	const __m256 dt = _mm256_set1_ps(step);
+	const __m256 bnc = _mm256_set1_ps(bounce);
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256 right = _mm256_set1_ps((float)width);
+	const __m256 bottom = _mm256_set1_ps((float)height);
+
+	int i = 0;
+	for(; i + 8 <= n; i += 8) {
+		__m256 r = _mm256_loadu_ps(&w.radius[i]);
+		__m256 px = _mm256_loadu_ps(&w.px[i]);
+		__m256 py = _mm256_loadu_ps(&w.py[i]);
+		__m256 vx = _mm256_mul_ps(_mm256_loadu_ps(&w.vx[i]), damp);
+		__m256 vy = _mm256_mul_ps(_mm256_loadu_ps(&w.vy[i]), damp);
+
+		_mm256_storeu_ps(&w.ppx[i], px);
+		_mm256_storeu_ps(&w.ppy[i], py);
+
+		px = _mm256_add_ps(px, _mm256_mul_ps(vx, dt));
+		py = _mm256_add_ps(py, _mm256_mul_ps(vy, dt));
+
+		__m256 left = _mm256_cmp_ps(px, r, _CMP_LT_OQ);
+		px = _mm256_blendv_ps(px, r, left);
+		vx = _mm256_blendv_ps(vx, _mm256_mul_ps(_mm256_andnot_ps(sign, vx), bnc), left);
+
+		__m256 top = _mm256_cmp_ps(py, r, _CMP_LT_OQ);
+		py = _mm256_blendv_ps(py, r, top);
+		vy = _mm256_blendv_ps(vy, _mm256_mul_ps(_mm256_andnot_ps(sign, vy), bnc), top);
+
+		__m256 rgt = _mm256_cmp_ps(_mm256_add_ps(px, r), right, _CMP_GT_OQ);
+		px = _mm256_blendv_ps(px, _mm256_sub_ps(right, r), rgt);
+		vx = _mm256_blendv_ps(vx, _mm256_mul_ps(_mm256_or_ps(sign, vx), bnc), rgt);
+
+		__m256 bot = _mm256_cmp_ps(_mm256_add_ps(py, r), bottom, _CMP_GT_OQ);
+		py = _mm256_blendv_ps(py, _mm256_sub_ps(bottom, r), bot);
+		vy = _mm256_blendv_ps(vy, _mm256_mul_ps(_mm256_or_ps(sign, vy), bnc), bot);
+
+		_mm256_storeu_ps(&w.px[i], px);
+		_mm256_storeu_ps(&w.py[i], py);
+		_mm256_storeu_ps(&w.vx[i], vx);
+		_mm256_storeu_ps(&w.vy[i], vy);
+
+		int hit = _mm256_movemask_ps(_mm256_or_ps(_mm256_or_ps(left, top), _mm256_or_ps(rgt, bot)));
+		for(int k = 0; k < 8; k++)
+			w.bounced[i+k] = ((hit >> k) & 1) && w.alive[i+k];
 	}
 
-	else if(way == "down") {
-		cloud[player]->vapor -= absorb;
-		cloud[player]->vy += 1;
-
-		for(int i = 0; i < MAX_CLOUDS; i++) {
-			if(!cloud[i]->alive) {
-				cloud[i] = new Cloud(cloud[player]->px, cloud[player]->py - cloud[player]->radius() - absorb, -cloud[player]->vx, -cloud[player]->vy, absorb);
-				cloud[i]->alive = true;
-				cloud[i]->type = raincloud;
-				cloud[i]->color = "gray";
-				break;
+	integrateScalar(w, i, n);
+}
+#endif
+
+void integrateFallback(World &w, int n) {
+	integrateScalar(w, 0, n);
+}
+
+// Picked once at startup by selectIntegrate()
+void (*integrate)(World &w, int n) = integrateFallback;
+const char *integrateName = "scalar";
+
+void selectIntegrate() {
+#ifdef CLOUDWARS_X86
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx2")) {
+		integrate = integrateAVX2;
+		integrateName = "AVX2";
+	} else if(__builtin_cpu_supports("sse2")) {
+		integrate = integrateSSE2;
+		integrateName = "SSE2";
+	}
+#endif
+
+	std::cout << "Integration: " << integrateName << std::endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Glyph Atlas
+////////////////////////////////////////////////////////////////////////////////
+
+// Every printable character of a font rendered once. Text that changes every
+// frame (the debug numbers) is drawn by blitting glyphs, so it costs no font
+// rendering and no surfaces.
+class GlyphAtlas {
+	public:
+		GlyphAtlas();
+		~GlyphAtlas();
+		void load(TTF_Font *f);
+		void clear();
+		int draw(int x, int y, const char *text, SDL_Surface *destination);
+		int width(const char *text);
+
+	private:
+		static const int FIRST = 32;
+		static const int LAST = 126;
+
+		SDL_Surface *glyph[LAST + 1];
+		int offsetX[LAST + 1];
+		int offsetY[LAST + 1];
+		int advance[LAST + 1];
+		int height;
+};
+
+GlyphAtlas::GlyphAtlas() {
+	for(int c = 0; c <= LAST; c++) {
+		glyph[c] = NULL;
+		offsetX[c] = offsetY[c] = advance[c] = 0;
+	}
+
+	height = 0;
+}
+
+GlyphAtlas::~GlyphAtlas() {
+	clear();
+}
+
+void GlyphAtlas::load(TTF_Font *f) {
+	clear();
+
+	if(!f)
+		return;
+
+	int ascent = TTF_FontAscent(f);
+	height = TTF_FontHeight(f);
+
+	for(int c = FIRST; c <= LAST; c++) {
+		int minx, maxx, miny, maxy;
+
+		if(TTF_GlyphMetrics(f, c, &minx, &maxx, &miny, &maxy, &advance[c]) != 0)
+			continue;
+
+		// The glyph surface is just the glyph, place it on the text line
+		glyph[c] = TTF_RenderGlyph_Solid(f, c, textColor);
+		offsetX[c] = minx;
+		offsetY[c] = ascent - maxy;
+	}
+}
+
+void GlyphAtlas::clear() {
+	for(int c = 0; c <= LAST; c++) {
+		SDL_FreeSurface(glyph[c]);
+		glyph[c] = NULL;
+	}
+}
+
+// Returns the width of what was drawn
+int GlyphAtlas::draw(int x, int y, const char *text, SDL_Surface *destination) {
+	int start = x;
+
+	// One dirty rectangle for the text, not one per glyph
+	bool tracking = trackDirty;
+	trackDirty = false;
+
+	for(const char *t = text; *t; t++) {
+		int c = (unsigned char)*t;
+
+		if(c < FIRST || c > LAST)
+			continue;
+
+		if(glyph[c])
+			drawSurface(x + offsetX[c], y + offsetY[c], glyph[c], destination);
+
+		x += advance[c];
+	}
+
+	trackDirty = tracking;
+
+	if(destination == screen)
+		markDirty(start - 2, y, x - start + 4, height);
+
+	return x - start;
+}
+
+int GlyphAtlas::width(const char *text) {
+	int w = 0;
+
+	for(const char *t = text; *t; t++) {
+		int c = (unsigned char)*t;
+
+		if(c >= FIRST && c <= LAST)
+			w += advance[c];
+	}
+
+	return w;
+}
+
+GlyphAtlas smallText;
+
+////////////////////////////////////////////////////////////////////////////////
+// Sprite Cache
+////////////////////////////////////////////////////////////////////////////////
+
+// Scaled cloud images, keyed by the source image and a quantized diameter.
+// Small clouds get an image per pixel size, bigger ones one of 16 sizes per
+// doubling, so a growing cloud goes through the same few images instead of
+// zooming a new one every frame. The least recently used images are freed
+// when the cache goes over its memory budget.
+class SpriteCache {
+	public:
+		SpriteCache();
+		~SpriteCache();
+		SDL_Surface *get(SDL_Surface *base, double diameter);
+		void clear();
+
+		size_t budget; // bytes
+
+	private:
+		typedef std::pair<SDL_Surface *, int> Key;
+
+		struct Entry {
+			Key key;
+			SDL_Surface *image;
+			size_t bytes;
+		};
+
+		int quantize(double diameter);
+
+		std::list<Entry> entries; // most recently used first
+		std::map<Key, std::list<Entry>::iterator> index;
+		size_t bytes;
+};
+
+SpriteCache::SpriteCache() {
+	budget = 0;
+	bytes = 0;
+}
+
+SpriteCache::~SpriteCache() {
+	clear();
+}
+
+int SpriteCache::quantize(double diameter) {
+	if(diameter <= 16)
+		return std::max(1, (int)(diameter + 0.5));
+
+	double level = floor(log2(diameter) * 16 + 0.5);
+	return pow(2, level / 16) + 0.5;
+}
+
+SDL_Surface *SpriteCache::get(SDL_Surface *base, double diameter) {
+	Key key(base, quantize(diameter));
+	std::map<Key, std::list<Entry>::iterator>::iterator found = index.find(key);
+
+	if(found != index.end()) {
+		entries.splice(entries.begin(), entries, found->second);
+		return found->second->image;
+	}
+
+	Entry entry;
+	entry.key = key;
+	entry.image = zoomSurface(base, key.second / (double)base->w, key.second / (double)base->h, SMOOTHING_OFF);
+	entry.bytes = entry.image ? entry.image->pitch * entry.image->h : 0;
+
+	entries.push_front(entry);
+	index[key] = entries.begin();
+	bytes += entry.bytes;
+
+	// Never evict the one we are about to draw
+	while(bytes > budget && entries.size() > 1) {
+		Entry &last = entries.back();
+
+		bytes -= last.bytes;
+		SDL_FreeSurface(last.image);
+		index.erase(last.key);
+		entries.pop_back();
+	}
+
+	return entry.image;
+}
+
+void SpriteCache::clear() {
+	for(std::list<Entry>::iterator e = entries.begin(); e != entries.end(); ++e)
+		SDL_FreeSurface(e->image);
+
+	entries.clear();
+	index.clear();
+	bytes = 0;
+}
+
+SpriteCache spriteCache;
+
+////////////////////////////////////////////////////////////////////////////////
+// Cloud Sprites
+////////////////////////////////////////////////////////////////////////////////
+
+// Everything needed to draw the cloud in a world slot. Only created when there
+// is a screen, headless mode never has any.
+class CloudSprite {
+	public:
+		CloudSprite(int slot, std::string col);
+		~CloudSprite();
+		void draw(const Snapshot &s);
+		void show(const Snapshot &s);
+		void drawName(const Snapshot &s);
+		void drawVapor(const Snapshot &s);
+		void drawVelocity(const Snapshot &s);
+		void drawPosition(const Snapshot &s);
+
+		int id; // world slot
+		float sx, sy; // Position on screen, interpolated between ticks
+		std::string color;
+
+		// The name label is only rendered again when the name changes
+		std::string nameText;
+		SDL_Surface *nameLabel;
+};
+
+CloudSprite::CloudSprite(int slot, std::string col) {
+	id = slot;
+	sx = 0;
+	sy = 0;
+	color = col;
+	nameLabel = NULL;
+}
+
+CloudSprite::~CloudSprite() {
+	SDL_FreeSurface(nameLabel);
+}
+
+void CloudSprite::draw(const Snapshot &s) {
+	Uint32 color;
+
+	if(id == 0)
+		color = 0x000000FF; // blue
+	else if(id == 1)
+		color = 0x00FF0000; // red
+
+	if(s.type[id] == raincloud)
+		color = 0x007F7F7F; // gray
+
+	drawCircle(screen, sx, sy, s.radius[id], color);
+	markDirty(sx - s.radius[id] - 1, sy - s.radius[id] - 1, s.radius[id] * 2 + 3, s.radius[id] * 2 + 3);
+}
+
+void CloudSprite::drawName(const Snapshot &s) {
+	if(!nameLabel || nameText != s.name[id]) {
+		nameText = s.name[id];
+		SDL_FreeSurface(nameLabel);
+		nameLabel = TTF_RenderText_Solid(font, nameText.c_str(), textColor);
+	}
+
+	drawSurface(sx - nameText.length() * 2, sy + s.radius[id] + 5, nameLabel, screen);
+}
+
+void CloudSprite::drawVapor(const Snapshot &s) {
+	char vs[32];
+	int length = formatFixed(vs, s.vapor[id], 2) - vs;
+
+	smallText.draw(sx - length * 2, sy - s.radius[id] - 10, vs, screen);
+}
+
+void CloudSprite::drawVelocity(const Snapshot &s) {
+	char vxs[32] = "vx: ";
+	formatFixed(vxs + 4, s.vx[id], 2); // to desimaler
+
+	char vys[32] = "vy: ";
+	formatFixed(vys + 4, s.vy[id], 2); // to desimaler
+
+	smallText.draw(sx + s.radius[id] + 10, sy - 5, vxs, screen);
+	smallText.draw(sx + s.radius[id] + 10, sy + 5, vys, screen);
+}
+
+void CloudSprite::drawPosition(const Snapshot &s) {
+	char pxs[32] = "px: ";
+	int length = formatInt(pxs + 4, (int)s.px[id]) - pxs;
+
+	char pys[32] = "py: ";
+	formatInt(pys + 4, (int)s.py[id]);
+
+	smallText.draw(sx - s.radius[id] - 10 - length * 6, sy - 5, pxs, screen);
+	smallText.draw(sx - s.radius[id] - 10 - length * 6, sy + 5, pys, screen);
+}
+
+void CloudSprite::show(const Snapshot &s) {
+	double diamenter = s.radius[id] * 2.6; // .6 pga skyene ikke fyller hele bildet!
+	SDL_Surface *base = gray;
+
+	if(color == "blue")
+		base = blue;
+	else if(color == "red")
+		base = red;
+
+	// The cached image is close to, not exactly, diamenter wide
+	SDL_Surface *cloudImage = spriteCache.get(base, diamenter);
+	drawSurface(sx - cloudImage->w / 2, sy - cloudImage->h / 2, cloudImage, screen);
+}
+
+std::vector<CloudSprite *> sprite;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Usage
+////////////////////////////////////////////////////////////////////////////////
+
+void usage() {
+	std::cout << "Usage: ./cloudwarsx -m [deathmatch, timelimit] -1 [ai, human] -2 [ai, human]" << std::endl;
+	std::cout << "\t-m gamemode\tdeathmatch / timelimit" << std::endl;
+	std::cout << "\t-s seconds\ttime limit in seconds" << std::endl;
+	std::cout << "\t-t ticks\tsimulation ticks per second" << std::endl;
+	std::cout << "\t-1 ai / human / file.so\tplayer 1" << std::endl;
+	std::cout << "\t-2 ai / human / file.so\tplayer 2" << std::endl;
+	std::cout << "\t-l filename\tlevel filename" << std::endl;
+	std::cout << "\t-r\t\tenable retromode (no gfx)" << std::endl;
+	std::cout << "\t-x width\tset width" << std::endl;
+	std::cout << "\t-y height\tset height" << std::endl;
+	std::cout << "\t-f\t\tenable fullscreen" << std::endl;
+	std::cout << "\t-p port\t\ttcp port for server" << std::endl;
+	std::cout << "\t-n\t\tno sound" << std::endl;
+	std::cout << "\t-d\t\tdebug mode" << std::endl;
+	std::cout << "\t-v\t\tshow the version" << std::endl;
+	std::cout << "\t--headless\tno window, sound or fonts (ai vs ai only)" << std::endl;
+	std::cout << "\t--sprite-cache mb\tmemory for scaled cloud images" << std::endl;
+	std::cout << "\t--pool threads\tserve ai vs ai games to every two clients, until killed (0: one thread per core)" << std::endl;
+	std::cout << "\t--tournament file\tplay the bots of the file against each other and exit" << std::endl;
+	std::cout << "\t--results file\twhere the tournament writes its games (results.csv)" << std::endl;
+	std::cout << "\t--record file\trecord the game for --replay (file.<id> for every game of --pool)" << std::endl;
+	std::cout << "\t--replay file\tplay a recorded game again, PageUp/PageDown seek 10 seconds" << std::endl;
+	std::cout << "\t--seek tick\tstart the replay at the tick" << std::endl;
+	std::cout << "\t--seed number\tthe random world and collisions of the game" << std::endl;
+	std::cout << "\t--benchmark file\ttime the simulation on generated worlds, write the results as csv" << std::endl;
+	std::cout << "\t--profile\ttime the phases of the game like -d, print them at exit" << std::endl;
+	std::cout << "\t--selftest\tcheck the collisions and saved states, exit 1 if something is wrong" << std::endl;
+	exit(1);
+}
+
+bool checkCollision(const World &world, int A, int B) {
+	//If the distance between the centers of the circles is less than the sum of their radii
+	//Both sides are squared, so there is no sqrt for the distance
+	float dx = world.px[B] - world.px[A];
+	float dy = world.py[B] - world.py[A];
+	float radii = world.radius[A] + world.radius[B];
+
+	return dx * dx + dy * dy < radii * radii;
+}
+
+// The smaller cloud gives absorb vapor at a time to the bigger one until they
+// no longer overlap. Instead of looping, solve for the vapor x left in the
+// smaller cloud when they just touch:
+//   sqrt(x) + sqrt(total - x) = d  =>  x^2 - total*x + ((d^2 - total)/2)^2 = 0
+// and round up to whole absorb units, which is where the loop would stop.
+void absorbCollision(World &world, Random &random, int A, int B) {
+	int small = A;
+	int big = B;
+
+	if(world.vapor[A] > world.vapor[B]) {
+		std::swap(small, big);
+	} else if(world.vapor[A] == world.vapor[B]) {
+		// random choose between thunderstorms
+		if(random.below(2) == 0)
+			std::swap(small, big);
+	}
+
+	double dx = world.px[B] - world.px[A];
+	double dy = world.py[B] - world.py[A];
+	double d2 = dx * dx + dy * dy;
+	double s = world.vapor[small];
+	double b = world.vapor[big];
+	double total = s + b;
+
+	// Past this many units the smaller cloud has nothing left (and its
+	// radius is NaN, which is what ended the loop)
+	int lastUnit = floor(s / absorb) + 1;
+	int units;
+
+	if(d2 <= total) {
+		// Even with all the vapor the bigger cloud covers the smaller one
+		units = lastUnit;
+	} else {
+		double k = (d2 - total) / 2;
+		double x = (total - sqrt(std::max(0.0, total * total - 4 * k * k))) / 2;
+		units = std::min(lastUnit, (int)ceil((s - x) / absorb));
+	}
+
+	// Rounding may put us one unit off from the first separated state
+	while(units > 1) {
+		double r = sqrt(s - (units - 1) * absorb) + sqrt(b + (units - 1) * absorb);
+		if(d2 < r * r)
+			break;
+		--units;
+	}
+
+	while(units < lastUnit) {
+		double r = sqrt(s - units * absorb) + sqrt(b + units * absorb);
+		if(d2 >= r * r)
+			break;
+		++units;
+	}
+
+	world.addVapor(small, -units * absorb);
+	world.addVapor(big, units * absorb);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Broad-phase grid
+////////////////////////////////////////////////////////////////////////////////
+
+// The screen is split into square cells as wide as 90% of the clouds, so two
+// clouds no wider than a cell can only touch if they are in the same or
+// neighbouring cells. The few clouds wider than that (the thunderstorms, and
+// whatever has absorbed a lot) are kept out of the cells: each of them looks
+// at the cells under it instead, and they are swept along x against each
+// other. Rebuilt every tick with a counting sort, no allocations once warmed
+// up.
+class Grid {
+	public:
+		Grid();
+		void build(const World &world);
+
+		// Every pair of alive clouds that may touch, each pair once
+		std::vector<std::pair<int, int> > pairs;
+
+	private:
+		int cellOf(float x, float y);
+		void pairCells(int a, int b);
+		void pairWide(const World &world, int i);
+
+		float cellSize;
+		int cols, rows;
+		std::vector<int> cellStart; // cellItems[cellStart[c] .. cellStart[c+1]) is cell c
+		std::vector<int> cellItems;
+		std::vector<int> itemCell;
+		std::vector<std::pair<float, int> > wide; // alive clouds wider than a cell, by left edge
+		std::vector<float> radii; // for the 90th percentile
+};
+
+Grid::Grid() {
+	cellSize = 1;
+	cols = rows = 0;
+}
+
+int Grid::cellOf(float x, float y) {
+	int cx = x / cellSize;
+	int cy = y / cellSize;
+
+	// Clouds may stick out of the screen until the next wall check
+	cx = std::max(0, std::min(cols - 1, cx));
+	cy = std::max(0, std::min(rows - 1, cy));
+
+	return cy * cols + cx;
+}
+
+void Grid::pairCells(int a, int b) {
+	for(int i = cellStart[a]; i < cellStart[a+1]; i++) {
+		for(int j = (a == b) ? i + 1 : cellStart[b]; j < cellStart[b+1]; j++) {
+			pairs.push_back(std::make_pair(cellItems[i], cellItems[j]));
+		}
+	}
+}
+
+// The cells under a wide cloud, as far as a cloud in them could reach it
+void Grid::pairWide(const World &world, int i) {
+	float reach = world.radius[i] + cellSize / 2;
+	int first = cellOf(world.px[i] - reach, world.py[i] - reach);
+	int last = cellOf(world.px[i] + reach, world.py[i] + reach);
+
+	for(int cy = first / cols; cy <= last / cols; cy++) {
+		for(int cx = first % cols; cx <= last % cols; cx++) {
+			int c = cy * cols + cx;
+
+			for(int k = cellStart[c]; k < cellStart[c+1]; k++)
+				pairs.push_back(std::make_pair(i, cellItems[k]));
+		}
+	}
+}
+
+void Grid::build(const World &world) {
+	radii.clear();
+
+	for(int i = 0; i < world.size(); i++) {
+		if(world.alive[i])
+			radii.push_back(world.radius[i]);
+	}
+
+	float typical = 1;
+
+	if(!radii.empty()) {
+		int k = radii.size() * 9 / 10;
+		std::nth_element(radii.begin(), radii.begin() + k, radii.end());
+		typical = std::max(typical, radii[k]);
+	}
+
+	// A few tiny clouds on a big screen don't need more than 4 cells each
+	cellSize = std::max(typical * 2, (float)sqrt((double)width * height / (4 * radii.size() + 1)));
+	cols = width / cellSize + 1;
+	rows = height / cellSize + 1;
+
+	cellStart.assign(cols * rows + 1, 0);
+	itemCell.assign(world.size(), -1);
+	wide.clear();
+
+	// Count clouds per cell, then turn the counts into start offsets
+	for(int i = 0; i < world.size(); i++) {
+		if(world.alive[i]) {
+			if(world.radius[i] * 2 > cellSize) {
+				wide.push_back(std::make_pair(world.px[i] - world.radius[i], i));
+				continue;
+			}
+
+			itemCell[i] = cellOf(world.px[i], world.py[i]);
+			++cellStart[itemCell[i] + 1];
+		}
+	}
+
+	for(int c = 0; c < cols * rows; c++)
+		cellStart[c+1] += cellStart[c];
+
+	cellItems.resize(cellStart[cols * rows]);
+	std::vector<int> fill(cellStart.begin(), cellStart.end() - 1);
+
+	for(int i = 0; i < world.size(); i++) {
+		if(itemCell[i] != -1)
+			cellItems[fill[itemCell[i]]++] = i;
+	}
+
+	// Only look forward (same, right and the three cells below) so that
+	// every neighbouring pair of cells is visited once
+	pairs.clear();
+
+	for(int cy = 0; cy < rows; cy++) {
+		for(int cx = 0; cx < cols; cx++) {
+			int c = cy * cols + cx;
+
+			if(cellStart[c] == cellStart[c+1])
+				continue;
+
+			pairCells(c, c);
+
+			if(cx + 1 < cols)
+				pairCells(c, c + 1);
+
+			if(cy + 1 < rows) {
+				if(cx > 0)
+					pairCells(c, c + cols - 1);
+
+				pairCells(c, c + cols);
+
+				if(cx + 1 < cols)
+					pairCells(c, c + cols + 1);
+			}
+		}
+	}
+
+	std::sort(wide.begin(), wide.end());
+
+	for(unsigned int w = 0; w < wide.size(); w++) {
+		int i = wide[w].second;
+		pairWide(world, i);
+
+		// Only the ones starting left of where this one ends
+		float right = world.px[i] + world.radius[i];
+
+		for(unsigned int v = w + 1; (v < wide.size()) && (wide[v].first < right); v++)
+			pairs.push_back(std::make_pair(i, wide[v].second));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// State messages
+////////////////////////////////////////////////////////////////////////////////
+
+// The GET_STATE reply for a snapshot. Built once per tick into a buffer that
+// is kept between ticks, every client asking during the tick gets the same
+// text. It is as long as the world needs, not limited by BUFFER_SIZE. The
+// two players differ in YOU only, each gets a reply of its own.
+class StateText {
+	public:
+		StateText();
+		const std::string &get(const Snapshot &s, int you);
+
+	private:
+		char *cloud(char *out, const char *tag, const Snapshot &s, int i);
+
+		int iteration[2];
+		std::string reply[2];
+};
+
+StateText::StateText() {
+	iteration[0] = iteration[1] = -1;
+}
+
+// TAG px py vx vy vapor\n
+char *StateText::cloud(char *out, const char *tag, const Snapshot &s, int i) {
+	while(*tag)
+		*out++ = *tag++;
+
+	*out++ = ' ';
+	out = formatFloat(out, s.px[i]);
+	*out++ = ' ';
+	out = formatFloat(out, s.py[i]);
+	*out++ = ' ';
+	out = formatFloat(out, s.vx[i]);
+	*out++ = ' ';
+	out = formatFloat(out, s.vy[i]);
+	*out++ = ' ';
+	out = formatFloat(out, s.vapor[i]);
+	*out++ = '\n';
+
+	return out;
+}
+
+const std::string &StateText::get(const Snapshot &s, int you) {
+	std::string &text = reply[you];
+
+	if(s.iteration == iteration[you])
+		return text;
+
+	// Room for the longest lines, the capacity stays once the world is this big
+	text.resize(64 + s.size * 96);
+	char *out = &text[0];
+
+	out = formatInt(out + sprintf(out, "BEGIN_STATE "), s.iteration);
+	*out++ = '\n';
+
+	// YOU x\n
+	out += sprintf(out, "YOU %d\n", you);
+
+	// THUNDERSTORM px py vx vy vapor\n
+	for(int i = 0; i < 2; i++)
+		out = cloud(out, "THUNDERSTORM", s, i);
+
+	// RAINCLOUD x y vx vy vapor\n
+	for(int i = 2; i < s.size; i++) {
+		if(s.alive[i])
+			out = cloud(out, "RAINCLOUD", s, i);
+	}
+
+	out += sprintf(out, "END_STATE\n");
+
+	text.resize(out - &text[0]);
+	iteration[you] = s.iteration;
+
+	return text;
+}
+
+// Binary replies to GET_STATE, for clients that asked with BINARY after NAME.
+// Everything is little-endian:
+//
+//   header, 40 bytes:
+//     u32 magic "CWST"
+//     u32 length of the whole reply, header included
+//     u32 iteration
+//     u32 you
+//     u32 format, 32 or 16
+//     u32 records, the two thunderstorms first, then the rainclouds
+//     f32 px, py, velocity and vapor scale (format 16 only, 1 otherwise)
+//
+//   record, format 32: f32 px, py, vx, vy, vapor (20 bytes)
+//   record, format 16: u16 px, py, i16 vx, vy, u16 vapor (10 bytes),
+//                      multiply by the scale for the value
+//
+// The records are aligned, so clients can read them in place.
+enum stateformats {
+	textState = 0,
+	shortState = 16,
+	floatState = 32
+};
+
+const Uint32 STATE_MAGIC = 0x54535743; // "CWST" in little-endian
+const int STATE_HEADER = 40;
+
+char *put16(char *out, Uint16 v) {
+	*out++ = v & 0xff;
+	*out++ = v >> 8;
+	return out;
+}
+
+char *put32(char *out, Uint32 v) {
+	*out++ = v & 0xff;
+	*out++ = (v >> 8) & 0xff;
+	*out++ = (v >> 16) & 0xff;
+	*out++ = v >> 24;
+	return out;
+}
+
+char *putFloat(char *out, float v) {
+	Uint32 bits;
+	memcpy(&bits, &v, 4);
+	return put32(out, bits);
+}
+
+Uint32 get32(const char *in) {
+	const unsigned char *b = (const unsigned char *)in;
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((Uint32)b[3] << 24);
+}
+
+float getFloat(const char *in) {
+	Uint32 bits = get32(in);
+	float v;
+	memcpy(&v, &bits, 4);
+	return v;
+}
+
+// Quantize v / scale to 0..max (or -max..max), rounded
+int quantizeField(float v, float scale, int min, int max) {
+	int q = floor(v / scale + 0.5);
+	return std::max(min, std::min(max, q));
+}
+
+// Like StateText, built once per tick for every client using the format
+class StateBinary {
+	public:
+		StateBinary(stateformats f);
+		const std::string &get(const Snapshot &s, int you);
+
+	private:
+		stateformats format;
+		int iteration[2];
+		std::string reply[2];
+};
+
+StateBinary::StateBinary(stateformats f) {
+	format = f;
+	iteration[0] = iteration[1] = -1;
+}
+
+const std::string &StateBinary::get(const Snapshot &s, int you) {
+	std::string &data = reply[you];
+
+	if(s.iteration == iteration[you])
+		return data;
+
+	int records = 2;
+	float maxVelocity = 0;
+	float maxVapor = 0;
+
+	for(int i = 0; i < s.size; i++) {
+		if((i < 2) || s.alive[i]) {
+			if(i >= 2)
+				++records;
+
+			maxVelocity = std::max(maxVelocity, std::max(fabsf(s.vx[i]), fabsf(s.vy[i])));
+			maxVapor = std::max(maxVapor, s.vapor[i]);
+		}
+	}
+
+	int recordSize = format == floatState ? 20 : 10;
+	data.resize(STATE_HEADER + records * recordSize);
+	char *out = &data[0];
+
+	// Whole range of the 16 bit fields, so nothing is clipped
+	float positionX = 1, positionY = 1, velocity = 1, vapor = 1;
+
+	if(format == shortState) {
+		positionX = width / 65535.0;
+		positionY = height / 65535.0;
+		velocity = maxVelocity > 0 ? maxVelocity / 32767 : 1;
+		vapor = maxVapor > 0 ? maxVapor / 65535 : 1;
+	}
+
+	out = put32(out, STATE_MAGIC);
+	out = put32(out, data.size());
+	out = put32(out, s.iteration);
+	out = put32(out, you);
+	out = put32(out, format);
+	out = put32(out, records);
+	out = putFloat(out, positionX);
+	out = putFloat(out, positionY);
+	out = putFloat(out, velocity);
+	out = putFloat(out, vapor);
+
+	for(int i = 0; i < s.size; i++) {
+		if((i >= 2) && !s.alive[i])
+			continue;
+
+		if(format == floatState) {
+			out = putFloat(out, s.px[i]);
+			out = putFloat(out, s.py[i]);
+			out = putFloat(out, s.vx[i]);
+			out = putFloat(out, s.vy[i]);
+			out = putFloat(out, s.vapor[i]);
+		} else {
+			out = put16(out, quantizeField(s.px[i], positionX, 0, 65535));
+			out = put16(out, quantizeField(s.py[i], positionY, 0, 65535));
+			out = put16(out, quantizeField(s.vx[i], velocity, -32767, 32767));
+			out = put16(out, quantizeField(s.vy[i], velocity, -32767, 32767));
+			out = put16(out, quantizeField(s.vapor[i], vapor, 0, 65535));
+		}
+	}
+
+	iteration[you] = s.iteration;
+	return data;
+}
+
+// State pushed to a client after SUBSCRIBE N, every N ticks. The first frame
+// and every KEYFRAME_INTERVAL frames after it have every cloud:
+//
+//   KEYFRAME iteration
+//   YOU x
+//   CLOUD slot px py vx vy vapor
+//   END_STATE
+//
+// The frames in between only have what changed since the last frame:
+//
+//   DELTA iteration
+//   CLOUD slot px py vx vy vapor   (new, or moved more than the thresholds)
+//   GONE slot                      (absorbed)
+//   END_STATE
+//
+// A cloud is compared with what this client was last sent, not with the last
+// tick, so small changes add up until they are sent.
+const int KEYFRAME_INTERVAL = 50;
+const float POSITION_THRESHOLD = 0.5;
+const float VELOCITY_THRESHOLD = 0.05;
+const float VAPOR_THRESHOLD = 0.5;
+
+class StateStream {
+	public:
+		StateStream();
+		void subscribe(int every);
+		bool due(const Snapshot &s);
+		const std::string &frame(const Snapshot &s, int you);
+
+		int every; // 0 when not subscribed
+
+	private:
+		bool changed(const Snapshot &s, int i);
+		char *cloud(char *out, const Snapshot &s, int i);
+
+		int iteration; // of the last frame sent
+		int frames; // since the last keyframe
+
+		// What the client was last sent, per slot
+		std::vector<float> px, py, vx, vy, vapor;
+		std::vector<unsigned char> alive;
+
+		std::string text;
+};
+
+StateStream::StateStream() {
+	every = 0;
+	iteration = -1;
+	frames = 0;
+}
+
+void StateStream::subscribe(int n) {
+	every = n;
+	iteration = -1;
+	frames = KEYFRAME_INTERVAL; // start with a keyframe
+}
+
+bool StateStream::due(const Snapshot &s) {
+	return every > 0 && (iteration < 0 || s.iteration - iteration >= every);
+}
+
+bool StateStream::changed(const Snapshot &s, int i) {
+	return !alive[i] ||
+		fabsf(s.px[i] - px[i]) > POSITION_THRESHOLD ||
+		fabsf(s.py[i] - py[i]) > POSITION_THRESHOLD ||
+		fabsf(s.vx[i] - vx[i]) > VELOCITY_THRESHOLD ||
+		fabsf(s.vy[i] - vy[i]) > VELOCITY_THRESHOLD ||
+		fabsf(s.vapor[i] - vapor[i]) > VAPOR_THRESHOLD;
+}
+
+// CLOUD slot px py vx vy vapor\n, and remember what was sent
+char *StateStream::cloud(char *out, const Snapshot &s, int i) {
+	out += sprintf(out, "CLOUD ");
+	out = formatInt(out, i);
+	*out++ = ' ';
+	out = formatFloat(out, s.px[i]);
+	*out++ = ' ';
+	out = formatFloat(out, s.py[i]);
+	*out++ = ' ';
+	out = formatFloat(out, s.vx[i]);
+	*out++ = ' ';
+	out = formatFloat(out, s.vy[i]);
+	*out++ = ' ';
+	out = formatFloat(out, s.vapor[i]);
+	*out++ = '\n';
+
+	px[i] = s.px[i];
+	py[i] = s.py[i];
+	vx[i] = s.vx[i];
+	vy[i] = s.vy[i];
+	vapor[i] = s.vapor[i];
+	alive[i] = true;
+
+	return out;
+}
+
+const std::string &StateStream::frame(const Snapshot &s, int you) {
+	bool keyframe = frames >= KEYFRAME_INTERVAL;
+
+	if((int)alive.size() < s.size) {
+		px.resize(s.size);
+		py.resize(s.size);
+		vx.resize(s.size);
+		vy.resize(s.size);
+		vapor.resize(s.size);
+		alive.resize(s.size, false);
+	}
+
+	text.resize(64 + s.size * 96);
+	char *out = &text[0];
+
+	if(keyframe) {
+		out += sprintf(out, "KEYFRAME ");
+		out = formatInt(out, s.iteration);
+		out += sprintf(out, "\nYOU %d\n", you);
+
+		for(int i = 0; i < s.size; i++) {
+			if(s.alive[i])
+				out = cloud(out, s, i);
+			else
+				alive[i] = false;
+		}
+
+		frames = 0;
+	} else {
+		out += sprintf(out, "DELTA ");
+		out = formatInt(out, s.iteration);
+		*out++ = '\n';
+
+		for(int i = 0; i < s.size; i++) {
+			if(s.alive[i]) {
+				if(changed(s, i))
+					out = cloud(out, s, i);
+			} else if(alive[i]) {
+				out += sprintf(out, "GONE ");
+				out = formatInt(out, i);
+				*out++ = '\n';
+				alive[i] = false;
+			}
+		}
+	}
+
+	out += sprintf(out, "END_STATE\n");
+	text.resize(out - &text[0]);
+
+	iteration = s.iteration;
+	++frames;
+
+	return text;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Command queue
+////////////////////////////////////////////////////////////////////////////////
+
+// A WIND for the simulation, and later its reply for the server
+class Command {
+	public:
+		int player;
+		int x, y;
+		const char *way; // "up", "down", "left" or "right" for the keys, else NULL
+		int client; // who gets the reply, -1 for none
+		int connection; // so a reply is not sent to the next client in the slot
+		int result; // what wind() returned, 1 is IGNORE
+};
+
+// Bounded and lock-free (Dmitry Vyukov's queue): every cell has a sequence
+// number saying if it is free for the producer of this round or holds a
+// command for the consumer of it. Producers claim a cell by moving tail on
+// with a compare-and-swap, so any number of threads can push. Only one
+// thread pops.
+class CommandQueue {
+	public:
+		CommandQueue(int size);
+		bool push(const Command &command);
+		bool pop(Command &command);
+
+	private:
+		struct Cell {
+			std::atomic<unsigned int> sequence;
+			Command command;
+		};
+
+		std::vector<Cell> cells;
+		unsigned int mask;
+		std::atomic<unsigned int> tail; // next cell to push
+		unsigned int head; // next cell to pop
+};
+
+// size has to be a power of two
+CommandQueue::CommandQueue(int size) : cells(size) {
+	mask = size - 1;
+	tail = 0;
+	head = 0;
+
+	for(int i = 0; i < size; i++)
+		cells[i].sequence = i;
+}
+
+// false when the queue is full
+bool CommandQueue::push(const Command &command) {
+	unsigned int position = tail.load(std::memory_order_relaxed);
+
+	for(;;) {
+		Cell &cell = cells[position & mask];
+		int lap = cell.sequence.load(std::memory_order_acquire) - position;
+
+		if(lap == 0) {
+			// Free, and ours unless another producer got it first
+			if(tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+				cell.command = command;
+				cell.sequence.store(position + 1, std::memory_order_release);
+				return true;
+			}
+		} else if(lap < 0) {
+			// Still holds the command of the last round
+			return false;
+		} else {
+			position = tail.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+// false when the queue is empty
+bool CommandQueue::pop(Command &command) {
+	Cell &cell = cells[head & mask];
+	int lap = cell.sequence.load(std::memory_order_acquire) - (head + 1);
+
+	if(lap < 0)
+		return false;
+
+	command = cell.command;
+	cell.sequence.store(head + mask + 1, std::memory_order_release);
+	++head;
+
+	return true;
+}
+
+// Applied WINDs on their way back to the server thread, from every match. A
+// client has one WIND in flight at most, so this never fills up.
+CommandQueue replies(2 * MAX_POOL_CLIENTS);
+
+////////////////////////////////////////////////////////////////////////////////
+// Replay
+////////////////////////////////////////////////////////////////////////////////
+
+// A replay file is a header and then records, everything little-endian:
+//   header: "CWRP", version, seed, tick rate, width, height, game mode and
+//           tick limit, then for both players the type, the name length and
+//           the name (u32 each, except the name)
+//   record: kind (u8), tick (u32), length of the rest (u32), then for
+//     'K' a keyframe, the match before the tick, see Match::save()
+//     'W' a WIND applied by the tick: player (u8), way (u8, 0 for x y,
+//         1 to 4 for up, down, left, right), x and y (i32)
+//     'E' the end, the match was over before the tick
+// The first record is the keyframe of tick 0. The simulation only depends on
+// the world and the commands, so the rest replays from them.
+const Uint32 REPLAY_MAGIC = 0x50525743; // "CWRP" in little-endian
+const Uint32 REPLAY_VERSION = 1;
+const int REPLAY_HEADER = 32;
+const int RECORD_HEADER = 9;
+const int WIND_RECORD = 10;
+
+const char *windWays[] = {NULL, "up", "down", "left", "right"};
+
+// What to seek a windowed replay to, from the keys. The simulation does it.
+std::atomic<int> seekTo(-1);
+
+// The slots and the free-list, for a keyframe
+void World::save(std::string &out) const {
+	size_t at = out.size();
+	out.resize(at + 8 + freeSlots.size() * 4 + size() * 30);
+
+	char *p = &out[at];
+	p = put32(p, size());
+	p = put32(p, freeSlots.size());
+
+	for(unsigned int i = 0; i < freeSlots.size(); i++)
+		p = put32(p, freeSlots[i]);
+
+	for(int i = 0; i < size(); i++) {
+		*p++ = type[i];
+		*p++ = alive[i];
+		p = putFloat(p, px[i]);
+		p = putFloat(p, py[i]);
+		p = putFloat(p, ppx[i]);
+		p = putFloat(p, ppy[i]);
+		p = putFloat(p, vx[i]);
+		p = putFloat(p, vy[i]);
+		p = putFloat(p, vapor[i]);
+	}
+}
+
+// Back to what save() wrote, returns where it ended. NULL if it doesn't fit
+// before end or isn't a world, and nothing is changed.
+const char *World::load(const char *in, const char *end) {
+	if(end - in < 8)
+		return NULL;
+
+	Uint32 slots = get32(in);
+	Uint32 freeCount = get32(in + 4);
+
+	if(8 + (Uint64)freeCount * 4 + (Uint64)slots * 30 > (Uint64)(end - in))
+		return NULL;
+
+	for(Uint32 i = 0; i < freeCount; i++) {
+		if(get32(in + 8 + i * 4) >= slots)
+			return NULL;
+	}
+
+	for(Uint32 i = 0; i < slots; i++) {
+		if((Uint8)in[8 + freeCount * 4 + i * 30] > raincloud)
+			return NULL;
+	}
+
+	in += 8;
+
+	px.resize(slots);
+	py.resize(slots);
+	ppx.resize(slots);
+	ppy.resize(slots);
+	vx.resize(slots);
+	vy.resize(slots);
+	vapor.resize(slots);
+	radius.resize(slots);
+	type.resize(slots);
+	alive.resize(slots);
+	bounced.assign(slots, false);
+
+	freeSlots.resize(freeCount);
+	for(Uint32 i = 0; i < freeCount; i++, in += 4)
+		freeSlots[i] = get32(in);
+
+	for(Uint32 i = 0; i < slots; i++, in += 30) {
+		type[i] = (types)in[0];
+		alive[i] = in[1];
+		px[i] = getFloat(in + 2);
+		py[i] = getFloat(in + 6);
+		ppx[i] = getFloat(in + 10);
+		ppy[i] = getFloat(in + 14);
+		vx[i] = getFloat(in + 18);
+		vy[i] = getFloat(in + 22);
+		vapor[i] = getFloat(in + 26);
+		radius[i] = sqrt(vapor[i]);
+	}
+
+	return in;
+}
+
+// A replay file mapped into memory. The tick reads its commands from here
+// instead of the queue, seeking starts from the last keyframe before.
+class Replay {
+	public:
+		Replay();
+		~Replay();
+		void open(const std::string &filename);
+		int keyframe(int tick) const;
+		size_t offset(int k) const { return keyframes[k].second; }
+		char kind(size_t at) const { return data[at]; }
+		int iteration(size_t at) const { return get32(data + at + 1); }
+		Uint32 length(size_t at) const { return get32(data + at + 5); }
+		size_t next(size_t at) const { return at + RECORD_HEADER + length(at); }
+
+		const char *data;
+		size_t size; // up to the last whole record
+		size_t position; // the next record for the tick
+
+		Uint32 seed;
+		int tickRate;
+		int width, height;
+		gamemodes mode;
+		int tickLimit;
+		types type[2];
+		std::string names[2];
+		int end; // the tick the match was over before
+		std::vector<State> states; // keyframes seeked to, restored without decoding them again
+
+	private:
+		size_t mapped;
+		std::vector<std::pair<int, size_t> > keyframes; // tick and where, in order
+};
+
+Replay::Replay() {
+	data = NULL;
+	size = mapped = position = 0;
+	end = 0;
+}
+
+Replay::~Replay() {
+	if(data)
+		munmap((void *)data, mapped);
+}
+
+void Replay::open(const std::string &filename) {
+	int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat info;
+
+	if((fd < 0) || (fstat(fd, &info) < 0) || (info.st_size < REPLAY_HEADER)) {
+		std::cout << "Error: " << filename << " is not a replay!" << std::endl;
+		exit(1);
+	}
+
+	// The pages are read as we play, even a long match opens at once
+	mapped = info.st_size;
+	void *map = mmap(NULL, mapped, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(map == MAP_FAILED) {
+		std::cout << "Error: Could not map " << filename << ": " << strerror(errno) << std::endl;
+		exit(1);
+	}
+
+	data = (const char *)map;
+
+	if((get32(data) != REPLAY_MAGIC) || (get32(data + 4) != REPLAY_VERSION)) {
+		std::cout << "Error: " << filename << " is not a replay of this version!" << std::endl;
+		exit(1);
+	}
+
+	seed = get32(data + 8);
+	tickRate = get32(data + 12);
+	width = get32(data + 16);
+	height = get32(data + 20);
+	mode = (gamemodes)get32(data + 24);
+	tickLimit = get32(data + 28);
+
+	if((tickRate <= 0) || (width <= 0) || (height <= 0) || ((mode != deathmatch) && (mode != timelimit)) || (tickLimit < 0)) {
+		std::cout << "Error: " << filename << " has a broken header!" << std::endl;
+		exit(1);
+	}
+
+	size_t at = REPLAY_HEADER;
+
+	for(int player = 0; player < 2; player++) {
+		Uint32 n = (at + 8 <= mapped) ? get32(data + at + 4) : 0;
+
+		if((at + 8 > mapped) || (n > mapped - at - 8) || (get32(data + at) > raincloud)) {
+			std::cout << "Error: " << filename << " has a broken header!" << std::endl;
+			exit(1);
+		}
+
+		type[player] = (types)get32(data + at);
+		at += 8;
+
+		names[player].assign(data + at, n);
+		at += n;
+	}
+
+	position = at;
+
+	// Index the keyframes. A recording cut off by a crash plays up to its last
+	// whole record.
+	end = -1;
+	int last = 0;
+
+	while((at + RECORD_HEADER <= mapped) && (next(at) <= mapped)) {
+		last = iteration(at);
+
+		if(kind(at) == 'E') {
+			end = last;
+			break;
+		}
+
+		if(kind(at) == 'K')
+			keyframes.push_back(std::make_pair(last, at));
+
+		at = next(at);
+	}
+
+	size = at;
+
+	if(end < 0)
+		end = last + 1;
+
+	if(keyframes.empty()) {
+		std::cout << "Error: " << filename << " has no keyframe!" << std::endl;
+		exit(1);
+	}
+
+	states.resize(keyframes.size());
+}
+
+// The last keyframe at or before tick, or the first
+int Replay::keyframe(int tick) const {
+	unsigned int k = 0;
+
+	while((k + 1 < keyframes.size()) && (keyframes[k + 1].first <= tick))
+		++k;
+
+	return k;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Plugins
+////////////////////////////////////////////////////////////////////////////////
+
+const int PLUGIN_WINDS = 4; // a plugin can WIND this many times a tick
+
+// A bot in a shared library, see plugin.h. It is called by the tick of its
+// match, so it reads the world itself instead of a copy.
+class Plugin {
+	public:
+		Plugin();
+		~Plugin();
+		void load(const std::string &filename);
+		void start(int player);
+		int tick(const World &world, int iteration, Wind *winds);
+		void end(int winner);
+
+		std::string name;
+
+	private:
+		void *library;
+		void *context;
+		int you;
+
+		void *(*onStart)(int you);
+		int (*onTick)(void *context, const WorldView &world, Wind *winds, int max);
+		void (*onEnd)(void *context, int winner);
+};
+
+Plugin::Plugin() {
+	library = NULL;
+	context = NULL;
+	you = 0;
+	onStart = NULL;
+	onTick = NULL;
+	onEnd = NULL;
+}
+
+Plugin::~Plugin() {
+	if(library)
+		dlclose(library);
+}
+
+void Plugin::load(const std::string &filename) {
+	// Without a slash dlopen() would search the library path, not here
+	std::string path = filename;
+	if(path.find('/') == std::string::npos)
+		path = "./" + path;
+
+	library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+
+	if(!library) {
+		std::cout << "Error: " << dlerror() << std::endl;
+		exit(1);
+	}
+
+	onStart = (void *(*)(int))dlsym(library, "on_start");
+	onTick = (int (*)(void *, const WorldView &, Wind *, int))dlsym(library, "on_tick");
+	onEnd = (void (*)(void *, int))dlsym(library, "on_end");
+
+	if(!onStart || !onTick) {
+		std::cout << "Error: " << filename << " has no on_start() or on_tick()!" << std::endl;
+		exit(1);
+	}
+
+	// The file name without the path and .so plays
+	name = filename.substr(filename.rfind('/') + 1);
+	name = name.substr(0, name.size() - 3);
+}
+
+void Plugin::start(int player) {
+	you = player;
+	context = onStart(you);
+}
+
+// The WINDs of the plugin for this tick, at most PLUGIN_WINDS
+int Plugin::tick(const World &world, int iteration, Wind *winds) {
+	WorldView view;
+	view.version = PLUGIN_VERSION;
+	view.iteration = iteration;
+	view.you = you;
+	view.width = width;
+	view.height = height;
+	view.tickRate = tickRate;
+	view.size = world.size();
+	view.px = world.px.data();
+	view.py = world.py.data();
+	view.vx = world.vx.data();
+	view.vy = world.vy.data();
+	view.vapor = world.vapor.data();
+	view.radius = world.radius.data();
+	view.alive = world.alive.data();
+
+	int n = onTick(context, view, winds, PLUGIN_WINDS);
+	return std::max(0, std::min(n, PLUGIN_WINDS));
+}
+
+void Plugin::end(int winner) {
+	if(onEnd)
+		onEnd(context, winner);
+}
+
+// A player given as a .so file
+bool isPlugin(const std::string &player) {
+	return (player.size() > 3) && (player.compare(player.size() - 3, 3, ".so") == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Match
+////////////////////////////////////////////////////////////////////////////////
+
+// One game and everything that changes with it. The window plays the global
+// game, with --pool the server starts a Match for every two clients and the
+// match pool ticks them.
+class Match {
+	public:
+		Match();
+		void setSeed(Uint32 s);
+		void createCloud(int i, types t, int v);
+		void loadLevel(std::string filename);
+		int wind(int player, int x, int y);
+		void wind(int player, std::string way);
+		void queueWind(int player, int x, int y);
+		void queueWind(int player, const char *way);
+		void tick();
+		void advance(Uint32 now);
+		void decideWinner();
+		void leave(int player);
+		void publishSnapshot();
+		void save(std::string &out) const;
+		const char *load(const char *in, const char *end);
+		bool record(const std::string &filename);
+		void stopRecording();
+		void seek(int to);
+		State capture() const;
+		void restore(const State &s);
+
+		World world;
+		std::string playerNames[2];
+		int iteration;
+		std::atomic<bool> done; // set by the simulation or by the player quitting
+		std::atomic<int> loser; // the player that left the game and lost it, -1 for none
+		int bounces; // ticks with a wall bounce so far, the renderer plays the sound
+		int Winner;
+		int X1, Y1, X2, Y2; // debug wind line
+		Uint32 COLOR;
+		Uint32 seed;
+		Random random;
+		Replay *replay; // played instead of the commands, NULL for a game
+		bool quiet; // a branch of a search, ticks without snapshots or prints
+		Plugin *plugins[2]; // the players that are plugins, NULL for the others
+
+		// Only the simulation changes the world. Everyone else reads the snapshots
+		// and hands their WINDs to tick() through the queue.
+		CommandQueue commands;
+		SnapshotBuffer snapshots;
+
+		// Only used by the server thread
+		int id;
+		bool claimed[2]; // the player has a human or a client
+		StateText stateText;
+		StateBinary stateFloat;
+		StateBinary stateShort;
+
+		double due; // SDL_GetTicks() time of the next tick, for the match pool
+
+	private:
+		void applyCommands();
+		void replayCommands();
+		void writeRecord(char kind, const char *data, size_t length);
+		void keyframe();
+
+		std::vector<Command> applied; // WINDs of this tick to reply to
+		std::ofstream recording; // the replay file, if we record
+		std::string scratch; // a keyframe, kept for its memory
+		Grid grid;
+		int thunderCloud; // slot for the next THUNDERSTORM of a level
+};
+
+Match::Match() : commands(64), stateFloat(floatState), stateShort(shortState) {
+	iteration = 0;
+	done = false;
+	loser = -1;
+	bounces = 0;
+	Winner = 0;
+	X1 = Y1 = X2 = Y2 = 0;
+	COLOR = 0;
+	setSeed(1);
+	replay = NULL;
+	quiet = false;
+	plugins[0] = plugins[1] = NULL;
+	id = 0;
+	claimed[0] = claimed[1] = false;
+	due = 0;
+	thunderCloud = 0;
+}
+
+// Called by tick(), and before the first tick
+void Match::publishSnapshot() {
+	Snapshot *s = snapshots.write();
+
+	s->copy(world);
+	s->iteration = iteration;
+	s->time = SDL_GetTicks();
+	s->bounces = bounces;
+	s->X1 = X1;
+	s->Y1 = Y1;
+	s->X2 = X2;
+	s->Y2 = Y2;
+	s->color = COLOR;
+	s->name[0] = playerNames[0];
+	s->name[1] = playerNames[1];
+
+	snapshots.publish(s);
+
+	if(subscribers > 0)
+		wakeServer();
+}
+
+// The game of the window, or the only game when headless
+Match game;
+
+// Before any cloud is created, the seed makes the whole match
+void Match::setSeed(Uint32 s) {
+	seed = s;
+	random.seed(s);
+}
+
+int Match::wind(int player, int x, int y) {
+
+	// draw line
+	if(debug) {
+		X1 = world.px[player];
+		Y1 = world.py[player];
+		X2 = x+X1;
+		Y2 = y+Y1;
+	}
+
+	// The strength of the wind is calculated as sqrt(x*x+y*y).
+	float strength = sqrt(x * x + y * y);
+
+	// This value is not allowed to be less than 1.0 or greater than vapor/2.
+	// If this happens, the WIND command is ignored.
+	if((strength < 1.0) || (strength > world.vapor[player] / 2)) {
+		if(debug)
+			COLOR = 0x00FF0000; // red
+		return 1; // IGNORE
+
+	} else {
+		// The vapor property of the thunderstorm will be reduced by strength.
+		world.addVapor(player, -strength);
+
+		// If the thunderstorm's amount of vapor goes below 1.0, the player dies
+		// and is removed from the player list. The player's client can be
+		// immediately disconnected with no prior warning.
+		if((world.vapor[player] <= 1.0) && !quiet) {
+			std::cout << "Vapor amount to low. Die!" << std::endl;
+		}
+
+		// The vector [(x / radius)*5, (y / radius)*5] is added to the velocity
+		// of the thunderstorm.
+		world.vx[player] += (x / world.radius[player]) * 5;
+		world.vy[player] += (y / world.radius[player]) * 5;
+
+		// The vector [wx, wy] is calculated as [x / strength, y / strength].
+		float wx = x / strength;
+		float wy = y / strength;
+
+		// Let vector [vx, vy] represent the velocity of the thunderstorm.
+		int vx = world.vx[player];
+		int vy = world.vy[player];
+
+		// A new raincloud is spawned with vapor equal to strength
+		float raincloud_radius = sqrt(strength);
+
+		// The distance to spawn the new raincloud at is calculated as:
+		// (int)((storm_radius + raincloud_radius) * 1.1)
+		int distance = (world.radius[player] + raincloud_radius) * 1.1;
+
+		// The position of the new raincloud is set to
+		// [(int)(px - wx * distance), (int)(py - wy * distance)]
+		int cpx = world.px[player] - wx * distance;
+		int cpy = world.py[player] - wy * distance;
+
+		// with velocity
+		// [-(x / strength)*20 + vx, -(y / strength)*20 + vy]
+		float cvx = -(x / strength) * 20 + vx;
+		float cvy = -(y / strength) * 20 + vy;
+
+		world.add(raincloud, cpx, cpy, cvx, cvy, strength);
+
+		if(debug)
+			COLOR = 0x0000FF00;
+
+		return 0; // OK
+	}
+}
+
+void Match::wind(int player, std::string way) {
+	if(way == "up") {
+		world.addVapor(player, -absorb);
+		world.vy[player] -= 1;
+
+		world.add(raincloud, world.px[player], world.py[player] + world.radius[player] + absorb, -world.vx[player], -world.vy[player], absorb);
+	}
+
+	else if(way == "down") {
+		world.addVapor(player, -absorb);
+		world.vy[player] += 1;
+
+		world.add(raincloud, world.px[player], world.py[player] - world.radius[player] - absorb, -world.vx[player], -world.vy[player], absorb);
+	}
+
+	else if(way == "left") {
+		world.addVapor(player, -absorb);
+		world.vx[player] -= 1;
+
+		world.add(raincloud, world.px[player] + world.radius[player] + absorb, world.py[player], -world.vx[player], -world.vy[player], absorb);
+	}
+
+	else if(way == "right") {
+		world.addVapor(player, -absorb);
+		world.vx[player] += 1;
+
+		world.add(raincloud, world.px[player] - world.radius[player] - absorb, world.py[player], -world.vx[player], -world.vy[player], absorb);
+	}
+}
+
+// Human input, applied by the next tick without a reply. Dropped when the
+// queue is full, the player is pressing faster than the game ticks.
+void Match::queueWind(int player, int x, int y) {
+	Command command;
+	command.player = player;
+	command.x = x;
+	command.y = y;
+	command.way = NULL;
+	command.client = -1;
+	command.connection = 0;
+	command.result = 0;
+	commands.push(command);
+}
+
+void Match::queueWind(int player, const char *way) {
+	Command command;
+	command.player = player;
+	command.x = 0;
+	command.y = 0;
+	command.way = way;
+	command.client = -1;
+	command.connection = 0;
+	command.result = 0;
+	commands.push(command);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Match pool
+////////////////////////////////////////////////////////////////////////////////
+
+// A fixed number of worker threads ticking every running match at tickRate.
+// The matches wait in a heap ordered by when their next tick is due, a worker
+// takes the first one once it is due, runs its ticks and puts it back. So a
+// match is only ever ticked by one worker at a time, and a few threads serve
+// any number of matches.
+class MatchPool {
+	public:
+		MatchPool();
+		void start(int workers);
+		void add(Match *m);
+		Match *finished();
+
+	private:
+		static int worker(void *data);
+		void work();
+
+		SDL_mutex *lock;
+		SDL_cond *changed; // a match was added or put back
+		std::vector<Match *> waiting; // heap, the first is due first
+		std::vector<Match *> over; // done, for the server to clean up
+		std::vector<SDL_Thread *> threads;
+};
+
+// Heap order, the match due last is the least
+bool dueLater(const Match *a, const Match *b) {
+	return a->due > b->due;
+}
+
+MatchPool::MatchPool() {
+	lock = NULL;
+	changed = NULL;
+}
+
+void MatchPool::start(int workers) {
+	lock = SDL_CreateMutex();
+	changed = SDL_CreateCond();
+
+	for(int i = 0; i < workers; i++)
+		threads.push_back(SDL_CreateThread(worker, this));
+}
+
+// The first tick is due right away
+void MatchPool::add(Match *m) {
+	SDL_mutexP(lock);
+
+	m->due = SDL_GetTicks();
+	waiting.push_back(m);
+	std::push_heap(waiting.begin(), waiting.end(), dueLater);
+
+	SDL_CondSignal(changed);
+	SDL_mutexV(lock);
+}
+
+// A match that is done and out of the pool, the caller deletes it. NULL when
+// there is none.
+Match *MatchPool::finished() {
+	Match *m = NULL;
+
+	SDL_mutexP(lock);
+
+	if(!over.empty()) {
+		m = over.back();
+		over.pop_back();
+	}
+
+	SDL_mutexV(lock);
+
+	return m;
+}
+
+int MatchPool::worker(void *data) {
+	((MatchPool *)data)->work();
+	return 0;
+}
+
+// Workers never stop, the pool runs until the process is killed
+void MatchPool::work() {
+	SDL_mutexP(lock);
+
+	for(;;) {
+		if(waiting.empty()) {
+			SDL_CondWait(changed, lock);
+			continue;
+		}
+
+		Uint32 now = SDL_GetTicks();
+		Match *m = waiting.front();
+
+		// Sleep until it is due, or until a match due earlier comes in
+		if(m->due > now) {
+			SDL_CondWaitTimeout(changed, lock, ceil(m->due - now));
+			continue;
+		}
+
+		std::pop_heap(waiting.begin(), waiting.end(), dueLater);
+		waiting.pop_back();
+
+		// Someone else has to sleep on the new first match
+		SDL_CondSignal(changed);
+		SDL_mutexV(lock);
+
+		m->advance(now);
+
+		SDL_mutexP(lock);
+
+		if(m->done) {
+			over.push_back(m);
+			wakeServer();
+		} else {
+			waiting.push_back(m);
+			std::push_heap(waiting.begin(), waiting.end(), dueLater);
+			SDL_CondSignal(changed);
+		}
+	}
+}
+
+MatchPool pool;
+
+////////////////////////////////////////////////////////////////////////////////
+// Server Thread
+////////////////////////////////////////////////////////////////////////////////
+
+// A connected client. Commands are lines ending with \n, whatever the TCP
+// segments look like: what has arrived of the next line waits in in. Replies
+// are collected in out and sent with one write by flush(), what the socket
+// does not take waits until epoll says it is writable again.
+class Client {
+	public:
+		Client();
+		void reset(int socket);
+		void send(const char *data, size_t length);
+		void flush();
+
+		int fd; // -1 when the slot is free
+		bool broken; // the socket failed or the client stopped reading, close it
+		int connection; // numbers the clients, a slot is used again
+		bool pending; // a WIND is waiting for its tick, the rest of in waits too
+		Match *match; // NULL while waiting in the lobby of --pool
+		int player; // -1 until NAME gets it a thunderstorm
+		std::string name;
+		stateformats format;
+		StateStream stream;
+		std::string in;
+		std::string out;
+};
+
+// A client that does not read its state for this long is dropped
+const size_t MAX_OUTPUT = 4 * 1024 * 1024;
+
+// Nothing we understand is this long, a client sending it without a \n is
+// dropped
+const size_t MAX_LINE = 4096;
+
+// Lines waiting behind a WIND, a client sending more is dropped
+const size_t MAX_INPUT = 1024 * 1024;
+
+Client::Client() {
+	reset(-1);
+}
+
+void Client::reset(int socket) {
+	fd = socket;
+	broken = false;
+	connection = 0;
+	pending = false;
+	match = poolSize > 0 ? NULL : &game;
+	player = -1;
+	name.clear();
+	format = textState;
+	stream.subscribe(0);
+	in.clear();
+	out.clear();
+}
+
+// Queued until flush()
+void Client::send(const char *data, size_t length) {
+	out.append(data, length);
+
+	if(out.size() > MAX_OUTPUT)
+		broken = true;
+}
+
+void Client::flush() {
+	size_t written = 0;
+
+	while(written < out.size()) {
+		ssize_t sent = ::send(fd, out.data() + written, out.size() - written, MSG_NOSIGNAL);
+
+		if(sent < 0) {
+			if((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				broken = true;
+
+			break;
+		}
+
+		written += sent;
+	}
+
+	out.erase(0, written);
+}
+
+// Grows up to MAX_POOL_CLIENTS with --pool, the index is the epoll data
+std::vector<Client> client;
+
+// NAMEd clients of --pool waiting for someone to play
+std::vector<int> lobby;
+int matchCount = 0;
+int connections = 0;
+
+void setNonBlocking(int fd) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// A client of a match of the pool is gone. A bot of the tournament loses its
+// game. Otherwise nobody would end a deathmatch that has no clients left, so
+// it is over once the last one is gone. Either way the pool hands it back to
+// endMatch() like any other.
+void leaveMatch(Match *m, int player) {
+	if(tournament && (player >= 0)) {
+		m->leave(player);
+		return;
+	}
+
+	for(unsigned int clientNumber = 0; clientNumber < client.size(); clientNumber++) {
+		if((client[clientNumber].fd >= 0) && (client[clientNumber].match == m))
+			return;
+	}
+
+	m->done = true;
+}
+
+void closeClient(int poller, int clientNumber) {
+	Match *m = client[clientNumber].match;
+	int player = client[clientNumber].player;
+
+	epoll_ctl(poller, EPOLL_CTL_DEL, client[clientNumber].fd, NULL);
+	close(client[clientNumber].fd);
+	client[clientNumber].reset(-1);
+	lobby.erase(std::remove(lobby.begin(), lobby.end(), clientNumber), lobby.end());
+	clientCount--;
+
+	if((poolSize > 0) && m && !m->done)
+		leaveMatch(m, player);
+}
+
+// The client number, or -1 when there are too many
+int addClient(int poller, int fd) {
+	int maxClients = poolSize > 0 ? MAX_POOL_CLIENTS : MAX_CLIENTS;
+
+	if(clientCount >= maxClients) {
+		std::cout << "Maximum client count reached - rejecting client connection" << std::endl;
+		close(fd);
+		return -1;
+	}
+
+	unsigned int freeSpot = 0;
+	while((freeSpot < client.size()) && (client[freeSpot].fd >= 0))
+		freeSpot++;
+
+	if(freeSpot == client.size())
+		client.push_back(Client());
+
+	int yes = 1;
+	setNonBlocking(fd);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+	client[freeSpot].reset(fd);
+	client[freeSpot].connection = ++connections;
+
+	epoll_event event;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.u32 = freeSpot;
+	epoll_ctl(poller, EPOLL_CTL_ADD, fd, &event);
+	clientCount++;
+
+	std::cout << "Client connected. There are now " << clientCount << " client(s) connected." << std::endl << std::endl;
+
+	return freeSpot;
+}
+
+// Two AI thunderstorms on the level, or on a random world when there is none
+Match *newMatch(const std::string &levelName) {
+	Match *m = new Match();
+	m->setSeed(rand());
+
+	if(levelName != "") {
+		m->loadLevel(levelName);
+	} else {
+		m->createCloud(0, ai, vaporStart);
+		m->createCloud(1, ai, vaporStart);
+
+		for(int i = 2; i < startClouds; i++)
+			m->createCloud(i, raincloud, 0);
+	}
+
+	m->world.type[0] = ai;
+	m->world.type[1] = ai;
+
+	// Something to send before the first tick
+	m->publishSnapshot();
+
+	return m;
+}
+
+// Both players have a client, START them and hand the match to the pool
+void playMatch(Match *m) {
+	for(unsigned int clientNumber = 0; clientNumber < client.size(); clientNumber++) {
+		Client &c = client[clientNumber];
+
+		if((c.fd >= 0) && (c.match == m)) {
+			std::cout << "Sending: START" << std::endl;
+			c.send("START\n", 6);
+			c.flush();
+		}
+	}
+
+	std::cout << "Match " << m->id << " start: " << m->playerNames[0] << " vs " << m->playerNames[1] << std::endl;
+
+	if(recordFile != "") {
+		std::stringstream filename;
+		filename << recordFile << "." << m->id;
+		m->record(filename.str());
+	}
+
+	m->publishSnapshot();
+	pool.add(m);
+}
+
+// The first two clients in the lobby play a new match in the pool
+void startMatch() {
+	Match *m = newMatch(level ? levelFile : "");
+	m->id = ++matchCount;
+
+	for(int player = 0; player < 2; player++) {
+		Client &c = client[lobby[player]];
+
+		c.match = m;
+		c.player = player;
+		m->claimed[player] = true;
+		m->playerNames[player] = c.name;
+	}
+
+	lobby.erase(lobby.begin(), lobby.begin() + 2);
+
+	playMatch(m);
+}
+
+// Disconnect the clients playing m
+void closeClients(int poller, Match *m) {
+	for(unsigned int clientNumber = 0; clientNumber < client.size(); clientNumber++) {
+		if((client[clientNumber].fd >= 0) && (client[clientNumber].match == m)) {
+			client[clientNumber].flush();
+			closeClient(poller, clientNumber);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Tournament
+////////////////////////////////////////////////////////////////////////////////
+
+// With --tournament the server plays every bot against every other bot on
+// every level, from both sides, poolSize games at a time. It starts the bots
+// itself: each player of a game gets a listener of its own on a free port and
+// {port} in the bot command becomes that port, so whoever connects there is
+// that player. Every game is a line in the results file.
+class Pairing {
+	public:
+		int bot[2]; // index in bots
+		std::string level; // empty for a random world
+		Match *match; // while it is played
+		int listener[2]; // -1 once the bot connected
+		pid_t pid[2];
+		Uint32 launched; // SDL_GetTicks()
+		Uint32 started; // 0 until both bots sent NAME
+		int winner; // like Match::Winner, -1 when a bot did not show up
+};
+
+std::vector<std::string> bots; // commands
+std::vector<std::string> levels;
+std::vector<Pairing> schedule;
+unsigned int nextPairing = 0;
+int playing = 0; // launched and not over yet
+std::ofstream results;
+
+// epoll data of the bot listeners, with the pairing and the player below
+const Uint32 BOT_LISTENER = 0x80000000;
+
+// A bot has this long to connect and send NAME
+const Uint32 BOT_TIMEOUT = 30000;
+
+// One "bot command" or "level filename" a line, # starts a comment
+void loadTournament(std::string filename) {
+	std::ifstream load(filename.c_str());
+	std::cout << "Loading tournament: " << filename << std::endl;
+
+	if(!load) {
+		std::cout << "Error: " << filename << " tournament file not found!" << std::endl;
+		exit(1);
+	}
+
+	std::string line;
+
+	while(std::getline(load, line)) {
+		if(line.compare(0, 4, "bot ") == 0) {
+			if(line.find("{port}") == std::string::npos) {
+				std::cout << "Error: The bot needs {port} to know where to connect: " << line << std::endl;
+				exit(1);
+			}
+
+			bots.push_back(line.substr(4));
+		} else if(line.compare(0, 6, "level ") == 0) {
+			std::ifstream check(line.substr(6).c_str());
+
+			if(!check) {
+				std::cout << "Error: " << line.substr(6) << " levelfile not found!" << std::endl;
+				exit(1);
+			}
+
+			levels.push_back(line.substr(6));
+		} else if((line != "") && (line[0] != '#')) {
+			std::cout << "Error: Not a bot or a level: " << line << std::endl;
+			exit(1);
+		}
+	}
+
+	if(bots.size() < 2) {
+		std::cout << "Error: A tournament needs at least two bots!" << std::endl;
+		exit(1);
+	}
+
+	if(levels.empty())
+		levels.push_back(level ? levelFile : "");
+
+	for(unsigned int l = 0; l < levels.size(); l++) {
+		for(unsigned int i = 0; i < bots.size(); i++) {
+			for(unsigned int j = 0; j < bots.size(); j++) {
+				if(i == j)
+					continue;
+
+				Pairing g;
+				g.bot[0] = i;
+				g.bot[1] = j;
+				g.level = levels[l];
+				g.match = NULL;
+				g.listener[0] = g.listener[1] = -1;
+				g.pid[0] = g.pid[1] = -1;
+				g.launched = g.started = 0;
+				g.winner = -1;
+				schedule.push_back(g);
+			}
+		}
+	}
+}
+
+// Quoted, for the results file
+std::string csvField(const std::string &s) {
+	std::string quoted = "\"";
+
+	for(unsigned int i = 0; i < s.size(); i++) {
+		if(s[i] == '"')
+			quoted += '"';
+
+		quoted += s[i];
+	}
+
+	return quoted + "\"";
+}
+
+// The bot command through the shell, with the output thrown away
+pid_t launchBot(const std::string &command, int botPort) {
+	std::string line = command;
+	char number[16];
+	sprintf(number, "%d", botPort);
+
+	size_t at;
+	while((at = line.find("{port}")) != std::string::npos)
+		line.replace(at, 6, number);
+
+	pid_t pid = fork();
+
+	if(pid == 0) {
+		// A group of its own, so killing it kills what the shell started too
+		setpgid(0, 0);
+
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, 1);
+
+		execl("/bin/sh", "sh", "-c", line.c_str(), (char *)NULL);
+		_exit(127);
+	}
+
+	if(pid < 0)
+		std::cout << "Could not start bot: " << strerror(errno) << std::endl;
+	else
+		setpgid(pid, pid);
+
+	return pid;
+}
+
+void stopBot(pid_t &pid) {
+	if(pid > 0) {
+		kill(-pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+	}
+
+	pid = -1;
+}
+
+void closeListener(int poller, Pairing &g, int player) {
+	if(g.listener[player] >= 0) {
+		epoll_ctl(poller, EPOLL_CTL_DEL, g.listener[player], NULL);
+		close(g.listener[player]);
+		g.listener[player] = -1;
+	}
+}
+
+// A bot connected to its listener, it plays that player
+void acceptBot(int poller, Uint32 id) {
+	Pairing &g = schedule[(id & ~BOT_LISTENER) >> 1];
+	int player = id & 1;
+
+	int fd = accept4(g.listener[player], NULL, NULL, SOCK_CLOEXEC);
+
+	if(fd < 0)
+		return;
+
+	closeListener(poller, g, player);
+
+	int clientNumber = addClient(poller, fd);
+
+	if(clientNumber >= 0) {
+		client[clientNumber].match = g.match;
+		client[clientNumber].player = player;
+	}
+}
+
+// The game is over, or never started: note it down and stop its bots
+void endPairing(int poller, Pairing &g) {
+	int n = &g - &schedule[0];
+	Match *m = g.match;
+
+	g.winner = g.started ? m->Winner : -1;
+
+	results << n + 1 << ',' << csvField(g.level) << ',' << csvField(bots[g.bot[0]]) << ',' << csvField(bots[g.bot[1]]) << ',' << g.winner;
+
+	if(g.started)
+		results << ',' << m->world.vapor[0] << ',' << m->world.vapor[1] << ',' << m->iteration << ',' << (SDL_GetTicks() - g.started) / 1000.0 << std::endl;
+	else
+		results << ",,,," << std::endl;
+
+	closeClients(poller, m);
+
+	for(int player = 0; player < 2; player++) {
+		closeListener(poller, g, player);
+		stopBot(g.pid[player]);
+	}
+
+	g.match = NULL;
+	--playing;
+}
+
+// A listener on a free port of the loopback, in the poller with id. -1 and
+// errno if there is none, like when we are out of file descriptors.
+int botListener(int poller, Uint32 id, int &botPort) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if(fd < 0)
+		return -1;
+
+	sockaddr_in address;
+	socklen_t length = sizeof(address);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0; // any free port
+
+	epoll_event event;
+	event.events = EPOLLIN | EPOLLET;
+	event.data.u32 = id;
+
+	if((bind(fd, (sockaddr *)&address, sizeof(address)) < 0) ||
+		(listen(fd, 1) < 0) ||
+		(getsockname(fd, (sockaddr *)&address, &length) < 0) ||
+		(epoll_ctl(poller, EPOLL_CTL_ADD, fd, &event) < 0)) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+
+	setNonBlocking(fd);
+	botPort = ntohs(address.sin_port);
+
+	return fd;
+}
+
+// Start games until poolSize of them are playing
+void launchPairings(int poller) {
+	while((playing < poolSize) && (nextPairing < schedule.size())) {
+		int n = nextPairing++;
+		Pairing &g = schedule[n];
+
+		g.match = newMatch(g.level);
+		g.match->id = n + 1;
+		g.launched = SDL_GetTicks();
+		++playing;
+
+		bool launched = true;
+
+		for(int player = 0; (player < 2) && launched; player++) {
+			int botPort;
+			g.listener[player] = botListener(poller, BOT_LISTENER | (n << 1) | player, botPort);
+
+			if(g.listener[player] < 0) {
+				std::cout << "Error: Game " << n + 1 << ": No port for the bot: " << strerror(errno) << std::endl;
+				launched = false;
+			} else {
+				g.pid[player] = launchBot(bots[g.bot[player]], botPort);
+				launched = (g.pid[player] > 0);
+			}
+		}
+
+		if(!launched) {
+			std::cout << "Game " << n + 1 << ": could not launch, not played" << std::endl;
+
+			Match *m = g.match;
+			endPairing(poller, g);
+			delete m;
+			continue;
+		}
+
+		std::cout << "Game " << n + 1 << " launched: " << bots[g.bot[0]] << " vs " << bots[g.bot[1]] << std::endl;
+	}
+}
+
+// Bots that are gone. Before its game started, a bot that exits (like a wrong
+// command), disconnects or takes longer than BOT_TIMEOUT means the game is
+// not played. Once it started, a bot that exits loses; a bot that disconnects
+// lost already in closeClient(), the pool ends its game.
+void checkBots(int poller) {
+	Uint32 now = SDL_GetTicks();
+
+	for(unsigned int n = 0; n < nextPairing; n++) {
+		Pairing &g = schedule[n];
+
+		if(!g.match)
+			continue;
+
+		std::string reason;
+
+		for(int player = 0; player < 2; player++) {
+			if((g.pid[player] > 0) && (waitpid(g.pid[player], NULL, WNOHANG) == g.pid[player])) {
+				g.pid[player] = -1;
+				reason = bots[g.bot[player]] + " exited";
+
+				if(g.started) {
+					std::cout << "Game " << n + 1 << ": " << reason << ", it loses" << std::endl;
+					g.match->leave(player);
+				}
+			}
+		}
+
+		if(g.started)
+			continue;
+
+		if((reason == "") && g.match->done)
+			reason = "a bot disconnected";
+
+		if((reason == "") && (now - g.launched > BOT_TIMEOUT))
+			reason = "a bot did not connect";
+
+		if(reason != "") {
+			std::cout << "Game " << n + 1 << ": " << reason << ", not played" << std::endl;
+
+			Match *m = g.match;
+			endPairing(poller, g);
+			delete m;
+		}
+	}
+}
+
+// Wins, draws, losses and no-shows of every bot
+void tournamentSummary() {
+	std::cout << "Tournament finish!" << std::endl;
+
+	for(unsigned int i = 0; i < bots.size(); i++) {
+		int won = 0, drawn = 0, lost = 0, missed = 0;
+
+		for(unsigned int n = 0; n < schedule.size(); n++) {
+			Pairing &g = schedule[n];
+
+			for(int player = 0; player < 2; player++) {
+				if(g.bot[player] != (int)i)
+					continue;
+
+				if(g.winner < 0)
+					++missed;
+				else if(g.winner == 0)
+					++drawn;
+				else if(g.winner == player + 1)
+					++won;
+				else
+					++lost;
+			}
+		}
+
+		std::cout << bots[i] << ": " << won << " won, " << drawn << " drawn, " << lost << " lost, " << missed << " not played" << std::endl;
+	}
+}
+
+// A match of the pool is done, its clients are disconnected like at the end
+// of the one game
+void endMatch(int poller, Match *m) {
+	m->stopRecording();
+	m->decideWinner();
+
+	std::cout << "Match " << m->id << " finish: " << m->playerNames[0] << " vs " << m->playerNames[1] << ": ";
+
+	if(m->Winner == 0)
+		std::cout << "Draw!" << std::endl;
+	else
+		std::cout << m->playerNames[m->Winner - 1] << " wins!" << std::endl;
+
+	if(tournament)
+		endPairing(poller, schedule[m->id - 1]);
+	else
+		closeClients(poller, m);
+
+	delete m;
+}
+
+// One line from a client, without the \n
+void handleCommand(int clientNumber, const std::string &s) {
+	ScopedTimer timer(serverPhase);
+	Client &c = client[clientNumber];
+	char buffer[BUFFER_SIZE];
+
+	// Every command of every match goes through here, a flushed line each
+	// would slow down the whole pool
+	if(debug)
+		std::cout << "Received: " << s << " from client number: " << clientNumber << "\n";
+
+	std::vector<std::string> v;
+
+	if(std::string::npos != s.find(" ")) {
+		split(s, ' ', v);
+	} else {
+		v.push_back(s);
+	}
+
+	// The thunderstorm we tell about and steer, spectators see player 1's
+	int you = std::max(0, c.player);
+
+	// NAME
+	if((v[0] == "NAME") && (v.size() > 1)) {
+		std::cout << "Client " << clientNumber << " name: " << v[1] << std::endl;
+		c.name = v[1];
+
+		// With --pool START comes once there is someone to play
+		if(poolSize > 0) {
+			if(c.match != NULL) {
+				// A bot of the tournament, the game starts when both are here
+				if(!c.match->claimed[c.player]) {
+					c.match->claimed[c.player] = true;
+					c.match->playerNames[c.player] = v[1];
+
+					// Not when the other bot is gone already
+					if(c.match->claimed[1 - c.player] && !c.match->done) {
+						schedule[c.match->id - 1].started = SDL_GetTicks();
+						playMatch(c.match);
+					}
+				}
+			} else if(std::find(lobby.begin(), lobby.end(), clientNumber) == lobby.end()) {
+				lobby.push_back(clientNumber);
+
+				if(lobby.size() == 2)
+					startMatch();
+			}
+
+			return;
+		}
+
+		// The first AI thunderstorm nobody has taken yet. The name is only
+		// set then, the game starts once every player is taken.
+		if(c.player < 0) {
+			for(int player = 0; player < 2; player++) {
+				if(!game.claimed[player]) {
+					game.claimed[player] = true;
+					game.playerNames[player] = v[1];
+					c.player = player;
+					++playerCount;
+					break;
+				}
+			}
+		}
+
+		if(c.player < 0) {
+			strcpy(buffer, "IGNORE\n");
+		} else {
+			std::cout << "Sending: START" << std::endl;
+			strcpy(buffer, "START\n");
+		}
+
+		c.send(buffer, strlen(buffer));
+	}
+
+	// GET_STATE, not before the lobby has a match for us
+	else if((s == "GET_STATE") && (c.match == NULL)) {
+		strcpy(buffer, "IGNORE\n");
+		c.send(buffer, strlen(buffer));
+	}
+
+	else if(s == "GET_STATE") {
+		// The latest tick, the simulation carries on meanwhile
+		Match &m = *c.match;
+		const Snapshot *state = m.snapshots.acquire();
+		const std::string *reply;
+
+		if(c.format == floatState)
+			reply = &m.stateFloat.get(*state, you);
+		else if(c.format == shortState)
+			reply = &m.stateShort.get(*state, you);
+		else
+			reply = &m.stateText.get(*state, you);
+
+		m.snapshots.release(state);
+
+		c.send(reply->data(), reply->size());
+	}
+
+	// SUBSCRIBE [every N ticks], 0 stops
+	else if(v[0] == "SUBSCRIBE") {
+		int every = v.size() > 1 ? atoi(v[1].c_str()) : 1;
+
+		if(every >= 0) {
+			c.stream.subscribe(every);
+			strcpy(buffer, "OK\n");
+		} else {
+			strcpy(buffer, "IGNORE\n");
+		}
+
+		c.send(buffer, strlen(buffer));
+	}
+
+	// BINARY [32 / 16]
+	else if(v[0] == "BINARY") {
+		int bits = v.size() > 1 ? atoi(v[1].c_str()) : 32;
+
+		if((bits == 32) || (bits == 16)) {
+			c.format = (stateformats)bits;
+			strcpy(buffer, "OK\n");
+		} else {
+			strcpy(buffer, "IGNORE\n");
+		}
+
+		c.send(buffer, strlen(buffer));
+	}
+
+	// WIND
+	else if((v[0] == "WIND") && (v.size() > 2)) {
+		Command command;
+		command.player = c.player;
+		command.x = atoi(v[1].c_str());
+		command.y = atoi(v[2].c_str());
+		command.way = NULL;
+		command.client = clientNumber;
+		command.connection = c.connection;
+		command.result = 1;
+
+		// The next tick applies it and the reply comes back through replies,
+		// until then nothing else of the client is handled
+		if((c.player >= 0) && c.match->commands.push(command)) {
+			c.pending = true;
+		} else {
+			strcpy(buffer, "IGNORE\n");
+			c.send(buffer, strlen(buffer));
+		}
+	}
+}
+
+// Every complete line, in order, up to a WIND waiting for its tick
+void handleLines(int clientNumber) {
+	Client &c = client[clientNumber];
+	size_t begin = 0;
+	size_t end;
+
+	while(!c.pending && ((end = c.in.find('\n', begin)) != std::string::npos)) {
+		size_t length = end - begin;
+
+		if((length > 0) && (c.in[end - 1] == '\r'))
+			--length;
+
+		if(length > 0)
+			handleCommand(clientNumber, c.in.substr(begin, length));
+
+		begin = end + 1;
+	}
+
+	c.in.erase(0, begin);
+}
+
+// Sleeps in epoll_wait until a client sends something, a socket can take
+// more output, or the simulation wakes it through wakeFd (a tick for the
+// subscribers, or a game is done). All sockets are non-blocking and
+// edge-triggered, so every event is read or written until EAGAIN.
+//
+// With --pool it runs on the main thread for good: NAMEd clients wait in the
+// lobby, every two of them get a Match of their own in the match pool.
+int server(void *data) {
+	char buffer[BUFFER_SIZE];
+
+	// epoll data for the two sockets that are not clients
+	const Uint32 LISTENER = 0xFFFFFFFF;
+	const Uint32 WAKEUP = 0xFFFFFFFE;
+
+	int poller = epoll_create1(EPOLL_CLOEXEC);
+	epoll_event event;
+
+	event.events = EPOLLIN | EPOLLET;
+	event.data.u32 = WAKEUP;
+	epoll_ctl(poller, EPOLL_CTL_ADD, wakeFd, &event);
+
+	// A tournament has no port of its own, only the listeners of its bots
+	int serverSocket = -1;
+
+	if(tournament) {
+		results.open(resultsFile.c_str());
+
+		if(!results) {
+			std::cout << "Error: Could not write " << resultsFile << std::endl;
+			exit(1);
+		}
+
+		results << "game,level,player1,player2,winner,vapor1,vapor2,ticks,seconds" << std::endl;
+		launchPairings(poller);
+	} else {
+		std::cout << "Starting server on port " << port << std::endl;
+
+		serverSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int yes = 1;
+		setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		address.sin_port = htons(port);
+
+		if((bind(serverSocket, (sockaddr *)&address, sizeof(address)) < 0) || (listen(serverSocket, 64) < 0)) {
+			std::cout << "Error: Could not listen on port " << port << ": " << strerror(errno) << std::endl;
+			exit(1);
+		}
+
+		setNonBlocking(serverSocket);
+
+		event.events = EPOLLIN | EPOLLET;
+		event.data.u32 = LISTENER;
+		epoll_ctl(poller, EPOLL_CTL_ADD, serverSocket, &event);
+
+		std::cout << "Waiting for clients to connect..." << std::endl;
+	}
+
+	epoll_event events[MAX_EVENTS];
+
+	while((poolSize > 0) || !game.done) {
+		// A tournament looks for bots that do not show up once a second
+		int count = epoll_wait(poller, events, MAX_EVENTS, tournament ? 1000 : -1);
+
+		for(int e = 0; e < count; e++) {
+			Uint32 id = events[e].data.u32;
+
+			if(id == WAKEUP) {
+				eventfd_t ticks;
+				eventfd_read(wakeFd, &ticks);
+				continue;
+			}
+
+			if(id == LISTENER) {
+				for(;;) {
+					int fd = accept4(serverSocket, NULL, NULL, SOCK_CLOEXEC);
+
+					if(fd < 0)
+						break;
+
+					addClient(poller, fd);
+				}
+
+				continue;
+			}
+
+			if(id & BOT_LISTENER) {
+				acceptBot(poller, id);
+				continue;
+			}
+
+			int clientNumber = id;
+			Client &c = client[clientNumber];
+
+			if(events[e].events & EPOLLOUT)
+				c.flush();
+
+			if(events[e].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				for(;;) {
+					ssize_t receivedByteCount = recv(c.fd, buffer, BUFFER_SIZE, 0);
+
+					if(receivedByteCount > 0) {
+						c.in.append(buffer, receivedByteCount);
+						continue;
+					}
+
+					// Closed, or failed with something else than EAGAIN
+					if((receivedByteCount == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+						c.broken = true;
+
+					break;
+				}
+
+				// The replies go out together
+				handleLines(clientNumber);
+
+				size_t lineEnd = c.in.rfind('\n');
+				size_t partial = lineEnd == std::string::npos ? c.in.size() : c.in.size() - lineEnd - 1;
+
+				if(partial > MAX_LINE) {
+					std::cout << "Client " << clientNumber << " sent a too long line." << std::endl;
+					c.broken = true;
+				}
+
+				if(c.in.size() > MAX_INPUT) {
+					std::cout << "Client " << clientNumber << " sent too much without waiting for replies." << std::endl;
+					c.broken = true;
+				}
+
+				c.flush();
+			}
+
+			if(c.broken) {
+				std::cout << "Client " << clientNumber << " disconnected." << std::endl << std::endl;
+				closeClient(poller, clientNumber);
+				std::cout << "Server is now connected to: " << clientCount << " client(s)." << std::endl << std::endl;
+			}
+		}
+
+		// WINDs the simulation has applied, their clients go on with the lines
+		// that waited behind them
+		Command reply;
+
+		while(replies.pop(reply)) {
+			Client &c = client[reply.client];
+
+			if((c.fd < 0) || (c.connection != reply.connection))
+				continue;
+
+			strcpy(buffer, reply.result ? "IGNORE\n" : "OK\n");
+			c.send(buffer, strlen(buffer));
+			c.pending = false;
+
+			handleLines(reply.client);
+			c.flush();
+
+			if(c.broken) {
+				std::cout << "Client " << reply.client << " disconnected." << std::endl << std::endl;
+				closeClient(poller, reply.client);
+			}
+		}
+
+		// Matches of the pool that are done
+		if(poolSize > 0) {
+			Match *m;
+			while((m = pool.finished()) != NULL)
+				endMatch(poller, m);
+		}
+
+		// The next games, until every one is played
+		if(tournament) {
+			checkBots(poller);
+			launchPairings(poller);
+
+			if((nextPairing == schedule.size()) && (playing == 0))
+				break;
+		}
+
+		// Push state to subscribers once their next tick is out
+		int subscribed = 0;
+
+		for(unsigned int clientNumber = 0; clientNumber < client.size(); clientNumber++) {
+			Client &c = client[clientNumber];
+
+			if((c.fd < 0) || (c.match == NULL))
+				continue;
+
+			const Snapshot *state = c.match->snapshots.acquire();
+
+			if(c.stream.due(*state)) {
+				const std::string &frame = c.stream.frame(*state, std::max(0, c.player));
+				c.send(frame.data(), frame.size());
+				c.flush();
+			}
+
+			c.match->snapshots.release(state);
+
+			if(c.broken) {
+				std::cout << "Client " << clientNumber << " disconnected." << std::endl << std::endl;
+				closeClient(poller, clientNumber);
+				continue;
+			}
+
+			if(c.stream.every > 0)
+				++subscribed;
+		}
+
+		// Only wake us every tick when someone is waiting for it
+		subscribers = subscribed;
+	}
+
+	for(unsigned int clientNumber = 0; clientNumber < client.size(); clientNumber++) {
+		if(client[clientNumber].fd >= 0)
+			closeClient(poller, clientNumber);
+	}
+
+	close(poller);
+
+	if(serverSocket >= 0)
+		close(serverSocket);
+
+	if(tournament)
+		tournamentSummary();
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Create cloud
+////////////////////////////////////////////////////////////////////////////////
+// Thunderstorms go in slot i, rainclouds in any free slot
+void Match::createCloud(int i, types t, int v) {
+	int vx = random.range(3);
+	int vy = random.range(3);
+
+	int vapor;
+
+	if(v == 0)
+		vapor = random.below(500) + 10;
+	else
+		vapor = v;
+
+	int radius = sqrt(vapor);
+	int px = random.below(width);
+	int py = random.below(height);
+
+	// Checking for out of bound position
+
+	// Left
+	if(px - radius <= 0)
+		px += radius;
+
+	// Right
+	if(px + radius > width)
+		px -= radius;
+
+	// Top
+	if(py - radius <= 0)
+		py += radius;
+
+	// Bootom
+	if(py + radius > height)
+		py -= radius;
+
+	if(t == raincloud)
+		world.add(t, px, py, vx, vy, vapor);
+	else
+		world.spawn(i, t, px, py, vx, vy, vapor);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Level functions
+////////////////////////////////////////////////////////////////////////////////
+
+void Match::loadLevel(std::string filename) {
+	std::ifstream load(filename.c_str());
+	std::cout << "Loading file: " << filename << std::endl;
+
+	if(!load) {
+		std::cerr << "Error: " << filename << " levelfile not found!" << std::endl;
+		exit(1);
+	}
+
+	while(!load.eof()) {
+		std::string cloudType;
+		float px, py;
+		float vx, vy;
+		float vapor;
+
+		load >> cloudType;
+		load >> px;
+		load >> py;
+		load >> vx;
+		load >> vy;
+		load >> vapor;
+
+		if( (cloudType != "") || (px) || (py) || (vx) || (vy) || (vapor) ) {
+			if(cloudType == "THUNDERSTORM") {
+				world.spawn(thunderCloud, ai, px, py, vx, vy, vapor);
+				++thunderCloud;
+			}
+
+			else if(cloudType == "RAINCLOUD") {
+				world.add(raincloud, px, py, vx, vy, vapor);
 			}
 		}
 	}
 
-	else if(way == "left") {
-		cloud[player]->vapor -= absorb;
-		cloud[player]->vx -= 1;
-
-		for(int i = 0; i < MAX_CLOUDS; i++) {
-			if(!cloud[i]->alive) {
-				cloud[i] = new Cloud(cloud[player]->px + cloud[player]->radius() + absorb, cloud[player]->py, -cloud[player]->vx, -cloud[player]->vy, absorb);
-				cloud[i]->alive = true;
-				cloud[i]->type = raincloud;
-				cloud[i]->color = "gray";
-				break;
+	load.close();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Game tick
+////////////////////////////////////////////////////////////////////////////////
+
+// The WINDs that came in since the last tick, in the order they came
+void Match::applyCommands() {
+	Command command;
+
+	while(commands.pop(command)) {
+		if(command.way)
+			wind(command.player, command.way);
+		else
+			command.result = wind(command.player, command.x, command.y);
+
+		if(command.client >= 0)
+			applied.push_back(command);
+
+		if(recording.is_open()) {
+			char data[WIND_RECORD];
+			data[0] = command.player;
+			data[1] = 0;
+
+			for(int way = 1; way <= 4; way++) {
+				if(command.way && !strcmp(command.way, windWays[way]))
+					data[1] = way;
+			}
+
+			put32(data + 2, command.x);
+			put32(data + 6, command.y);
+			writeRecord('W', data, WIND_RECORD);
+		}
+	}
+}
+
+// One fixed step of the simulation, always 1 / tickRate seconds of game time
+void Match::tick() {
+	if(replay) {
+		// The match was over here when it was recorded
+		if(iteration >= replay->end) {
+			done = true;
+			return;
+		}
+
+		replayCommands();
+	} else {
+		if(recording.is_open() && (iteration > 0) && (iteration % KEYFRAME_TICKS == 0))
+			keyframe();
+
+		// Plugins WIND through the queue too, applied right away
+		for(int player = 0; player < 2; player++) {
+			if(plugins[player]) {
+				Wind winds[PLUGIN_WINDS];
+				int n = plugins[player]->tick(world, iteration, winds);
+
+				for(int i = 0; i < n; i++)
+					queueWind(player, winds[i].x, winds[i].y);
 			}
 		}
+
+		applyCommands();
 	}
 
-	else if(way == "right") {
-		cloud[player]->vapor -= absorb;
-		cloud[player]->vx += 1;
-
-		for(int i = 0; i < MAX_CLOUDS; i++) {
-			if(!cloud[i]->alive) {
-				cloud[i] = new Cloud(cloud[player]->px - cloud[player]->radius() - absorb, cloud[player]->py, -cloud[player]->vx, -cloud[player]->vy, absorb);
-				cloud[i]->alive = true;
-				cloud[i]->type = raincloud;
-				cloud[i]->color = "gray";
+////////////////////////////////////////////////////////////////////////////////
+// Moving the clouds and checking for collision between boundaries
+////////////////////////////////////////////////////////////////////////////////
+
+	{
+		ScopedTimer timer(integratePhase);
+		integrate(world, world.size());
+
+		// The renderer plays the sound when it sees the count change
+		for(int i = 0; i < world.size(); i++) {
+			if(world.bounced[i]) {
+				++bounces;
 				break;
 			}
 		}
 	}
+
+////////////////////////////////////////////////////////////////////////////////
+// Collision Testing
+////////////////////////////////////////////////////////////////////////////////
+
+	{
+		ScopedTimer timer(collisionPhase);
+
+		// Only pairs of clouds in neighbouring grid cells can touch
+		grid.build(world);
+
+		for(unsigned int p = 0; p < grid.pairs.size(); p++) {
+			int i = grid.pairs[p].first;
+			int j = grid.pairs[p].second;
+
+			if(checkCollision(world, i, j)) {
+				absorbCollision(world, random, i, j);
+
+				/*
+				// Play sound if collision
+				if(collision) {
+					if(!nosound) {
+						Mix_PlayMusic(absorbSound, 0);
+						std::cout << "play" << std::endl;
+					}
+				}
+				*/
+			}
+		}
+	}
+
+	// Clouds absorbed down to nothing
+	{
+		ScopedTimer timer(sweepPhase);
+
+		for(int i = 2; i < world.size(); i++) {
+			if(world.alive[i]) {
+				if(world.vapor[i] <= 1.0) {
+					world.kill(i);
+				}
+			}
+		}
+	}
+
+////////////////////////////////////////////////////////////////////////////////
+// Endgame
+////////////////////////////////////////////////////////////////////////////////
+
+	if(gamemode == timelimit) {
+		if(iteration >= tickLimit) {
+			if(!quiet) {
+				std::cout << "Time's' up!" << std::endl;
+				std::cout << "Player 1 vapor: " << world.vapor[0] << std::endl;
+				std::cout << "Player 2 vapor: " << world.vapor[1] << std::endl;
+			}
+
+			done = true;
+		}
+	}
+
+	if(world.vapor[0] <= 1.0) {
+		Winner = 2;
+		done = true;
+	} else if(world.vapor[1] <= 1.0) {
+		Winner = 1;
+		done = true;
+	}
+
+	++iteration;
+
+	if(!quiet)
+		publishSnapshot();
+
+	// Replies only now, so a GET_STATE after the OK already sees the wind
+	if(!applied.empty()) {
+		for(unsigned int i = 0; i < applied.size(); i++) {
+			while(!replies.push(applied[i]))
+				SDL_Delay(0);
+		}
+
+		applied.clear();
+		wakeServer();
+	}
+}
+
+// Runs the ticks due by now, like the simulation thread but for the match
+// pool. A match that falls behind skips ahead, so it never holds its worker
+// for more than maxTicksPerFrame ticks.
+void Match::advance(Uint32 now) {
+	double msPerTick = 1000.0 / tickRate;
+	int ticks = 0;
+
+	while(!done && due <= now) {
+		tick();
+		due += msPerTick;
+
+		if(++ticks == maxTicksPerFrame) {
+			if(due <= now)
+				due = now + msPerTick;
+
+			break;
+		}
+	}
+}
+
+// Whoever has the most vapor, for the timelimit mode or a player quitting.
+// A player that left loses, whatever the vapor says.
+void Match::decideWinner() {
+	if(loser >= 0)
+		Winner = 2 - loser;
+	else if(world.vapor[0] > world.vapor[1])
+		Winner = 1;
+	else if(world.vapor[0] < world.vapor[1])
+		Winner = 2;
+	else
+		Winner = 0;
+}
+
+// The player is gone before the end, the first one to leave loses
+void Match::leave(int player) {
+	if(done)
+		return;
+
+	int none = -1;
+	loser.compare_exchange_strong(none, player);
+	done = true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Server Thread
+// Recording and replay
 ////////////////////////////////////////////////////////////////////////////////
 
-int server(void *data) {
-	IPaddress serverIP;
-	TCPsocket serverSocket;
-	TCPsocket clientSocket[MAX_CLIENTS];
-	bool socketIsFree[MAX_CLIENTS];
+// Everything the next tick depends on, what a keyframe holds
+void Match::save(std::string &out) const {
+	char head[12];
+	char *p = put32(head, iteration);
+	p = put32(p, bounces);
+	p = put32(p, random.state);
+	out.append(head, p - head);
 
-	char buffer[BUFFER_SIZE];
-	int receivedByteCount = 0;
-	bool shutdownServer = false;
+	world.save(out);
+}
+
+// Back to what save() wrote, returns where it ended
+const char *Match::load(const char *in, const char *end) {
+	if(end - in < 12)
+		return NULL;
+
+	const char *after = world.load(in + 12, end);
+	if(!after)
+		return NULL;
+
+	iteration = get32(in);
+	bounces = get32(in + 4);
+	random.state = get32(in + 8);
+	done = false;
+	Winner = 0;
+
+	return after;
+}
+
+// A copy of everything the next tick depends on, see State
+State Match::capture() const {
+	State::Header header;
+	header.iteration = iteration;
+	header.bounces = bounces;
+	header.winner = Winner;
+	header.random = random.state;
+	header.done = done;
+
+	std::vector<char> *buffer = new std::vector<char>(sizeof(header) + world.flatSize());
+	memcpy(buffer->data(), &header, sizeof(header));
+	world.copyOut(buffer->data() + sizeof(header));
+
+	State s;
+	s.buffer.reset(buffer);
+	return s;
+}
+
+// Back to a captured state. The world keeps its memory when the slot count
+// is the same, so restoring a branch again and again does not allocate.
+void Match::restore(const State &s) {
+	State::Header header;
+	memcpy(&header, s.buffer->data(), sizeof(header));
+
+	iteration = header.iteration;
+	bounces = header.bounces;
+	Winner = header.winner;
+	random.state = header.random;
+	done = header.done;
+
+	world.copyIn(s.buffer->data() + sizeof(header));
+}
+
+void Match::writeRecord(char kind, const char *data, size_t length) {
+	char head[RECORD_HEADER];
+	head[0] = kind;
+	put32(head + 1, iteration);
+	put32(head + 5, length);
 
-	SDLNet_Init();
-	SDLNet_SocketSet socketSet = SDLNet_AllocSocketSet(MAX_SOCKETS);
- 
-	for(int loop = 0; loop < MAX_CLIENTS; loop++) {
-		clientSocket[loop] = NULL;
-		socketIsFree[loop] = true;
+	recording.write(head, RECORD_HEADER);
+	recording.write(data, length);
+}
+
+void Match::keyframe() {
+	scratch.clear();
+	save(scratch);
+	writeRecord('K', scratch.data(), scratch.size());
+}
+
+// Start the replay file, before the first tick. The file is only appended
+// to, a tick writes its WINDs and every KEYFRAME_TICKS a keyframe.
+bool Match::record(const std::string &filename) {
+	recording.open(filename.c_str(), std::ios::binary | std::ios::trunc);
+
+	if(!recording) {
+		std::cout << "Error: Could not write the replay " << filename << std::endl;
+		return false;
 	}
 
-	std::cout << "Starting server on port " << port << std::endl;
- 
-	SDLNet_ResolveHost(&serverIP, NULL, port);
-	serverSocket = SDLNet_TCP_Open(&serverIP);
-	SDLNet_TCP_AddSocket(socketSet, serverSocket);
+	char head[REPLAY_HEADER];
+	char *p = put32(head, REPLAY_MAGIC);
+	p = put32(p, REPLAY_VERSION);
+	p = put32(p, seed);
+	p = put32(p, tickRate);
+	p = put32(p, width);
+	p = put32(p, height);
+	p = put32(p, gamemode);
+	p = put32(p, tickLimit);
+	recording.write(head, REPLAY_HEADER);
+
+	for(int player = 0; player < 2; player++) {
+		p = put32(head, world.type[player]);
+		p = put32(p, playerNames[player].size());
+		recording.write(head, p - head);
+		recording << playerNames[player];
+	}
 
-	std::cout << "Waiting for clients to connect..." << std::endl;
- 
-	do {
-		int numActiveSockets = SDLNet_CheckSockets(socketSet, 0);
+	keyframe();
+	return true;
+}
+
+// After the last tick
+void Match::stopRecording() {
+	if(!recording.is_open())
+		return;
+
+	writeRecord('E', NULL, 0);
+	recording.close();
+}
+
+// The commands of this tick from the replay instead of the queue
+void Match::replayCommands() {
+	while((replay->position < replay->size) && (replay->iteration(replay->position) <= iteration)) {
+		size_t at = replay->position;
+		const char *data = replay->data + at + RECORD_HEADER;
+
+		if((replay->kind(at) == 'W') && (replay->length(at) >= WIND_RECORD)) {
+			int player = data[0] ? 1 : 0;
+			int way = data[1];
+
+			if((way >= 1) && (way <= 4))
+				wind(player, windWays[way]);
+			else
+				wind(player, (int)get32(data + 2), (int)get32(data + 6));
+		} else if(replay->kind(at) == 'K') {
+			// We should be exactly where the recording was
+			scratch.clear();
+			save(scratch);
+
+			if((scratch.size() != replay->length(at)) || memcmp(scratch.data(), data, scratch.size())) {
+				if(load(data, data + replay->length(at)))
+					std::cout << "Warning: The replay is out of sync at tick " << iteration << ", going on from its keyframe" << std::endl;
+				else
+					std::cout << "Warning: The keyframe at tick " << iteration << " of the replay is broken, going on without it" << std::endl;
+			}
+		}
+
+		replay->position = replay->next(at);
+	}
+}
 
-		if(numActiveSockets != 0) {
-			std::cout << "There are currently " << numActiveSockets << " socket(s) with data to be processed." << std::endl;
+// To the state before tick to: from the keyframe before it, and the ticks
+// after the keyframe played again
+void Match::seek(int to) {
+	int k = replay->keyframe(to);
+	size_t at = replay->offset(k);
+
+	if(replay->states[k].empty()) {
+		if(!load(replay->data + at + RECORD_HEADER, replay->data + replay->next(at))) {
+			std::cout << "Error: The keyframe at tick " << replay->iteration(at) << " of the replay is broken!" << std::endl;
+			exit(1);
 		}
 
-		int serverSocketActivity = SDLNet_SocketReady(serverSocket);
+		replay->states[k] = capture();
+	} else {
+		restore(replay->states[k]);
+	}
 
-		memset(&buffer[0], 0, sizeof(buffer));
+	replay->position = replay->next(at);
 
-		if(serverSocketActivity != 0) {
-			if(clientCount < MAX_CLIENTS) {
-				int freeSpot = -99;
+	while(!done && (iteration < to))
+		tick();
 
-				for(int loop = 0; loop < MAX_CLIENTS; loop++) {
-					if(socketIsFree[loop] == true) {
-						socketIsFree[loop] = false;
-						freeSpot = loop;
-						break;
-					}
-				}
+	publishSnapshot();
+}
 
-				clientSocket[freeSpot] = SDLNet_TCP_Accept(serverSocket);
-				SDLNet_TCP_AddSocket(socketSet, clientSocket[freeSpot]);
-				clientCount++;
+////////////////////////////////////////////////////////////////////////////////
+// Simulation Thread
+////////////////////////////////////////////////////////////////////////////////
 
-				std::cout << "Client connected. There are now " << clientCount << " client(s) connected." << std::endl << std::endl;
+// Ticks at tickRate until the game is done. Headless runs it on the main
+// thread, as fast as the simulation allows when nobody plays over the
+// network: AIs on a socket need the wall clock to think and send commands.
+int simulation(void *data) {
+	bool freeRun = game.replay || (game.plugins[0] && game.plugins[1]);
 
-			} else {
-				std::cout << "Maximum client count reached - rejecting client connection" << std::endl;
+	if(headless && freeRun) {
+		while(!game.done)
+			game.tick();
+
+		return 0;
+	}
+
+	float msPerTick = 1000.0 / tickRate;
+	float accumulator = 0;
+	Uint32 lastTime = SDL_GetTicks();
+
+	while(!game.done) {
+		// The keys of a replay
+		int to = seekTo.exchange(-1);
+		if(to >= 0)
+			game.seek(to);
+
+		Uint32 now = SDL_GetTicks();
+		accumulator += now - lastTime;
+		lastTime = now;
+
+		// Catch up with the wall clock, but never spiral if we fall behind
+		int ticks = 0;
+		while(!game.done && accumulator >= msPerTick) {
+			game.tick();
+			accumulator -= msPerTick;
+
+			if(++ticks == maxTicksPerFrame) {
+				accumulator = 0;
+				break;
 			}
 		}
 
-		for(int clientNumber = 0; clientNumber < MAX_CLIENTS; clientNumber++) {
-			int clientSocketActivity = SDLNet_SocketReady(clientSocket[clientNumber]);
+		// Sleep until the next tick is due
+		SDL_Delay(msPerTick - accumulator);
+	}
 
-			if(clientSocketActivity != 0) {
-				receivedByteCount = SDLNet_TCP_Recv(clientSocket[clientNumber], buffer, BUFFER_SIZE);
+	return 0;
+}
 
-				if(receivedByteCount <= 0) {
-					std::cout << "Client " << clientNumber << " disconnected." << std::endl << std::endl;
-					SDLNet_TCP_DelSocket(socketSet, clientSocket[clientNumber]);
-					SDLNet_TCP_Close(clientSocket[clientNumber]);
-					clientSocket[clientNumber] = NULL;
-					socketIsFree[clientNumber] = true;
-					clientCount--;
+////////////////////////////////////////////////////////////////////////////////
+// Benchmark
+////////////////////////////////////////////////////////////////////////////////
 
-					std::cout << "Server is now connected to: " << clientCount << " client(s)." << std::endl << std::endl;
+// The simulation alone (integration, the grid, collisions and absorbing) on
+// generated worlds that are the same every run. Every cloud starts in its own
+// cell of a lattice, small enough not to touch another one until they move.
+// Sparse worlds have 100x100 pixel cells, dense ones 30x30. Absorbing thins a
+// world out, so once less than
+// BENCHMARK_ALIVE of it is left it starts over from its first tick, outside
+// the timing. The big worlds get fewer ticks, so every scenario takes about
+// as long.
+const Uint32 BENCHMARK_SEED = 1986;
+const float BENCHMARK_ALIVE = 0.9;
+
+// n clouds on a lattice of spacing pixels, none touching another one
+void latticeWorld(Match *m, int n, int spacing) {
+	int side = ceil(sqrt(n));
+	int maxRadius = std::min(spacing / 2 - 2, 22); // 22 is about the biggest new raincloud
+
+	width = height = side * spacing;
+
+	for(int i = 0; i < n; i++) {
+		float vapor = m->random.below(maxRadius * maxRadius - 10) + 10;
+		int slack = spacing / 2 - sqrt(vapor) - 1;
+
+		float px = (i % side) * spacing + spacing / 2 + m->random.range(slack);
+		float py = (i / side) * spacing + spacing / 2 + m->random.range(slack);
+		float vx = m->random.range(3);
+		float vy = m->random.range(3);
+
+		if(i < 2)
+			m->world.spawn(i, ai, px, py, vx, vy, vapor);
+		else
+			m->world.add(raincloud, px, py, vx, vy, vapor);
+	}
+}
 
-				} else {
-					std::cout << "Received: " << buffer << " from client number: " << clientNumber << std::endl;
+void benchmark(const std::string &filename) {
+	const int clouds[] = {50, 500, 5000, 50000};
+	const char *densities[] = {"sparse", "dense"};
+	const int spacing[] = {100, 30};
 
+	std::ofstream out(filename.c_str());
 
-					std::vector<std::string> v;
-					v.clear();
-					std::string s = buffer;
+	if(!out) {
+		std::cout << "Error: Could not write " << filename << std::endl;
+		exit(1);
+	}
 
-					if(std::string::npos != s.find(" ")) {
-						split(s, ' ', v);
-					} else {
-						v.push_back(s);
-					}
+	out << "scenario,clouds,width,height,ticks,mean_alive,restarts,ticks_per_second,ns_per_cloud_tick,p50_us,p99_us,max_us,integration" << std::endl;
 
-					s.erase(std::remove(s.begin(), s.end(), '\n'), s.end());
-
-					// NAME
-					if(v[0] == "NAME") {
-						std::cout << "Client " << clientNumber << " name: " << v[1] << std::endl;
-						cloud[0]->name = v[1];
-						std::cout << "Sending: START" << std::endl;
-						++playerCount;
-						strcpy(buffer, "START\n");
-						int msgLength = strlen(buffer);
-						SDLNet_TCP_Send(clientSocket[clientNumber], (void *)buffer, msgLength);
-					}
+	for(int d = 0; d < 2; d++) {
+		for(int c = 0; c < 4; c++) {
+			int n = clouds[c];
 
-					// GET_STATE
-					if(s == "GET_STATE") {
-						std::stringstream begin;
-						begin << "BEGIN_STATE " << iteration << std::endl;
-						std::string Begin = begin.str();
-
-						strcpy(buffer, Begin.c_str());
-						int msgLength = strlen(buffer);
-						SDLNet_TCP_Send(clientSocket[clientNumber], (void *)buffer, msgLength);
-
-						// YOU x\n
-						std::stringstream you;
-						you << "YOU " << 1 << std::endl;
-						std::string You = you.str();
-						
-						strcpy(buffer, You.c_str());
-						msgLength = strlen(buffer);
-						SDLNet_TCP_Send(clientSocket[clientNumber], (void *)buffer, msgLength);
-
-						// THUNDERSTORM px py vx vy vapor\n
-						for(int i = 0; i < 2; i++) {
-							std::stringstream thunder;
-							thunder << "THUNDERSTORM " << cloud[i]->px << " " << cloud[i]->py << " " << cloud[i]->vx << " " << cloud[i]->vy << " " << cloud[i]->vapor << std::endl;
-							std::string foo = thunder.str();
-
-							strcpy(buffer, foo.c_str());
-							msgLength = strlen(buffer);
-							SDLNet_TCP_Send(clientSocket[clientNumber], (void *)buffer, msgLength);
-						}
+			Match *m = new Match();
+			m->quiet = true;
+			m->setSeed(BENCHMARK_SEED);
 
-						// RAINCLOUD x y vx vy vapor\n
-						for(int i = 2; i < MAX_CLOUDS; i++) {
-							if(cloud[i]->alive) {
-								std::stringstream rain;
-								rain << "RAINCLOUD " << cloud[i]->px << " " << cloud[i]->py << " " << cloud[i]->vx << " " << cloud[i]->vy << " " << cloud[i]->vapor << std::endl;
-								std::string foo = rain.str();
-
-								strcpy(buffer, foo.c_str());
-								msgLength = strlen(buffer);
-								SDLNet_TCP_Send(clientSocket[clientNumber], (void *)buffer, msgLength);
-							}
-						}
+			latticeWorld(m, n, spacing[d]);
 
-						strcpy(buffer, "END_STATE\n");
-						msgLength = strlen(buffer);
-						SDLNet_TCP_Send(clientSocket[clientNumber], (void *)buffer, msgLength);
-					}
+			State first = m->capture();
+			int restarts = 0;
 
-					// WIND
-					else if(v[0] == "WIND") {
-						int x,y;
-						x = atoi(v[1].c_str());
-						y = atoi(v[2].c_str());
-
-						if(wind(0, x, y)) {
-							strcpy(buffer, "IGNORE\n");
-							int msgLength = strlen(buffer);
-							SDLNet_TCP_Send(clientSocket[clientNumber], (void *)buffer, msgLength);
-						} else {
-							strcpy(buffer, "OK\n");
-							int msgLength = strlen(buffer);
-							SDLNet_TCP_Send(clientSocket[clientNumber], (void *)buffer, msgLength);
-						}
-					}
+			int ticks = std::max(200, std::min(20000, 20000000 / n));
+			std::vector<Uint64> times(ticks);
+			Uint64 total = 0;
+			long long cloudTicks = 0; // clouds alive at each tick, added up
+
+			for(int t = 0; t < ticks; t++) {
+				int alive = 0;
+				for(int i = 0; i < m->world.size(); i++)
+					alive += m->world.alive[i];
+
+				if(m->done || (alive < n * BENCHMARK_ALIVE)) {
+					m->restore(first);
+					alive = n;
+					++restarts;
 				}
+
+				cloudTicks += alive;
+
+				Uint64 start = nanoTime();
+				m->tick();
+				times[t] = nanoTime() - start;
+				total += times[t];
 			}
+
+			std::sort(times.begin(), times.end());
+
+			double seconds = total / 1e9;
+			double nsPerCloud = (double)total / std::max(1LL, cloudTicks);
+			double p50 = times[ticks / 2] / 1000.0;
+			double p99 = times[ticks * 99 / 100] / 1000.0;
+			double max = times[ticks - 1] / 1000.0;
+
+			out << densities[d] << "," << n << "," << width << "," << height << "," << ticks << ","
+				<< cloudTicks / ticks << "," << restarts << "," << (int)(ticks / seconds) << "," << nsPerCloud << "," << p50 << "," << p99 << "," << max << ","
+				<< integrateName << std::endl;
+
+			std::cout << densities[d] << " " << n << " clouds: " << (int)(ticks / seconds) << " ticks/s, "
+				<< nsPerCloud << " ns per cloud per tick, p99 " << p99 << " us" << std::endl;
+
+			delete m;
 		}
-	} while(!done);
+	}
 
-	SDLNet_FreeSocketSet(socketSet);
-	SDLNet_TCP_Close(serverSocket);
-	SDLNet_Quit();
+	std::cout << "Benchmark written to " << filename << std::endl;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Random range: -x to x but never 0
+// Self test
 ////////////////////////////////////////////////////////////////////////////////
 
-int randomRange(int x) {
-	int random = 0;
-	while(random == 0) {
-		random = rand() % (x+x+1) - x;
+// absorbCollision() against the loop it replaced, which moved absorb vapor at
+// a time until the clouds no longer touched:
+//   while(checkCollision(world, i, j)) { smaller -= absorb; bigger += absorb; }
+// The loop compares float radii and the closed form doubles, so where the two
+// clouds end up exactly touching they may stop one unit apart. Anything else
+// is a failure.
+const int SELFTEST_PAIRS = 200000;
+
+void absorbLoop(World &world, int A, int B) {
+	while(checkCollision(world, A, B)) {
+		if(world.vapor[A] < world.vapor[B]) {
+			world.addVapor(A, -absorb);
+			world.addVapor(B, absorb);
+		} else {
+			world.addVapor(A, absorb);
+			world.addVapor(B, -absorb);
+		}
 	}
-	return random;
+}
+
+bool testAbsorb() {
+	Random random;
+	random.seed(BENCHMARK_SEED);
+
+	World loop, closed;
+	int same = 0, tangent = 0, wrong = 0;
+
+	for(int n = 0; n < SELFTEST_PAIRS; n++) {
+		// Two overlapping clouds of different sizes, anywhere from just
+		// touching to one on top of the other
+		float a = random.below(5000) + 2;
+		float b = random.below(5000) + 2;
+
+		if(a == b)
+			b += 1;
+
+		float d = (sqrt(a) + sqrt(b)) * (random.below(10000) + 1) / 10001;
+		float angle = random.below(3600) * M_PI / 1800;
+
+		loop.spawn(2, raincloud, 500, 500, 0, 0, a);
+		loop.spawn(3, raincloud, 500 + d * cos(angle), 500 + d * sin(angle), 0, 0, b);
+		closed = loop;
+
+		absorbLoop(loop, 2, 3);
+		absorbCollision(closed, random, 2, 3);
+
+		float off = fabs(loop.vapor[2] - closed.vapor[2]);
+
+		if(off == 0) {
+			++same;
+			continue;
+		}
+
+		// One of them stopped where the clouds touch, up to float rounding
+		double dx = closed.px[3] - closed.px[2];
+		double dy = closed.py[3] - closed.py[2];
+		double distance = sqrt(dx * dx + dy * dy);
+		double gap = std::min(fabs(distance - closed.radius[2] - closed.radius[3]), fabs(distance - loop.radius[2] - loop.radius[3]));
+
+		if((off == absorb) && (gap < 1e-3)) {
+			++tangent;
+		} else {
+			if(wrong < 10)
+				std::cout << "absorb " << a << " and " << b << " at " << d << ": loop " << loop.vapor[2] << ", closed form " << closed.vapor[2] << std::endl;
+
+			++wrong;
+		}
+	}
+
+	std::cout << "absorbCollision: " << same << " of " << SELFTEST_PAIRS << " pairs like the loop, "
+		<< tangent << " one unit off at tangency, " << wrong << " wrong" << std::endl;
+
+	return wrong == 0;
+}
+
+// Saved states: a match forked from a State twice and given the same WINDs
+// ends up the same both times, as the match that was captured when it is
+// given them too, and the State and that match are left as they were.
+const int SELFTEST_CLOUDS = 5000;
+const int SELFTEST_TICKS = 1000;
+
+// The same WINDs every time, every 50 ticks one of the players blows
+void windTicks(Match &m, int ticks) {
+	for(int t = 0; t < ticks; t++) {
+		if(m.iteration % 50 == 0)
+			m.wind(m.iteration / 50 % 2, m.iteration % 7 - 3, m.iteration % 5 - 2);
+
+		m.tick();
+	}
+}
+
+bool testStates() {
+	Match parent;
+	parent.quiet = true;
+	parent.setSeed(BENCHMARK_SEED);
+
+	for(int i = 0; i < SELFTEST_CLOUDS; i++)
+		parent.createCloud(i, (i < 2) ? ai : raincloud, (i < 2) ? vaporStart : 0);
+
+	windTicks(parent, 100);
+
+	std::string captured, left, a, b, again;
+	State root = parent.capture();
+	parent.save(captured);
+
+	Match branch;
+	branch.quiet = true;
+
+	// Two forks of the same State, the second one from a copy of it. The
+	// second restore has the memory already, like a search restoring often.
+	branch.restore(root);
+	windTicks(branch, SELFTEST_TICKS);
+	branch.save(a);
+
+	State copy = root;
+	Uint64 start = nanoTime();
+	branch.restore(copy);
+	Uint64 restoring = nanoTime() - start;
+
+	windTicks(branch, SELFTEST_TICKS);
+	branch.save(b);
+
+	// The parent was not touched, and goes the same way
+	parent.save(left);
+	windTicks(parent, SELFTEST_TICKS);
+	parent.save(again);
+
+	// And the State did not change either
+	std::string restored;
+	branch.restore(root);
+	branch.save(restored);
+
+	bool ok = true;
+
+	if(a != b) {
+		std::cout << "State: two forks of the same state went different ways" << std::endl;
+		ok = false;
+	}
+
+	if(left != captured) {
+		std::cout << "State: the forks changed the match they were captured from" << std::endl;
+		ok = false;
+	}
+
+	if(again != a) {
+		std::cout << "State: a fork went another way than the match it was captured from" << std::endl;
+		ok = false;
+	}
+
+	if(restored != captured) {
+		std::cout << "State: the forks changed the state" << std::endl;
+		ok = false;
+	}
+
+	std::cout << "State: " << SELFTEST_CLOUDS << " clouds, " << root.size() << " bytes, restored in "
+		<< restoring / 1000.0 << " us, forks " << (ok ? "exact" : "wrong") << " after " << SELFTEST_TICKS << " ticks" << std::endl;
+
+	return ok;
+}
+
+// Everything above, exit 1 if something failed. It runs with "make test".
+int selftest() {
+	bool ok = testAbsorb();
+	ok = testStates() && ok;
+
+	return ok ? 0 : 1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Create cloud
+// Render
 ////////////////////////////////////////////////////////////////////////////////
-void createCloud(int i, int v) {
-	int vx = randomRange(3);
-	int vy = randomRange(3);
 
-	int vapor;
+// Areas drawn in the previous frame, they are restored before drawing again
+std::vector<SDL_Rect> lastRects;
 
-	if(v == 0)
-		vapor = rand() % 500 + 10;
-	else
-		vapor = v;
+// Draw and update the whole screen on the next frame
+bool fullRedraw = true;
 
-	int radius = sqrt(vapor);
-	int px = rand() % width;
-	int py = rand() % height;
+void restoreBackground(SDL_Rect r) {
+	if(retro) {
+		SDL_FillRect(screen, &r, SDL_MapRGB(screen->format, 0x00, 0x00, 0x00));
+	} else {
+		SDL_Rect offset = r;
+		SDL_BlitSurface(background, &r, screen, &offset);
+	}
+}
 
-	// Checking for out of bound position
+// alpha is how far we are between the previous and the current tick (0..1)
+void render(const Snapshot &s, float alpha) {
+	ScopedTimer timer(drawingPhase);
 
-	// Left
-	if(px - radius <= 0)
-		px += radius;
+	// Bounce sound, once for however many bounces happened since last frame
+	static int lastBounces = 0;
+
+	if(s.bounces != lastBounces) {
+		if(!nosound)
+			Mix_PlayMusic(bounceSound, 0);
+
+		lastBounces = s.bounces;
+	}
+
+	// Update title with time if gamemode is timelimit
+	if(gamemode == timelimit) {
+		std::stringstream ssLimit;
+		ssLimit << timeLimit;
+		std::stringstream ssTime;
+		ssTime << s.iteration / tickRate;
+
+		std::string title2 = title + " - " + ssTime.str() + "/" + ssLimit.str();
+		SDL_WM_SetCaption(title2.c_str(), title2.c_str());
+	}
+
+	// Background, only where something was drawn last frame
+	if(fullRedraw) {
+		if(retro)
+			SDL_FillRect(screen, &screen->clip_rect, SDL_MapRGB(screen->format, 0x00, 0x00, 0x00));
+		else
+			drawSurface(0, 0, background, screen);
+	} else {
+		for(unsigned int i = 0; i < lastRects.size(); i++)
+			restoreBackground(lastRects[i]);
+	}
 
-	// Right
-	if(px + radius > width)
-		px -= radius;
+	dirtyRects.clear();
+	trackDirty = true;
 
-	// Top
-	if(py - radius <= 0)
-		py += radius;
+	// Sprites for new world slots
+	while((int)sprite.size() < s.size) {
+		int i = sprite.size();
 
-	// Bootom
-	if(py + radius > height)
-		py -= radius;
+		if(i == 0)
+			sprite.push_back(new CloudSprite(i, "blue"));
+		else if(i == 1)
+			sprite.push_back(new CloudSprite(i, "red"));
+		else
+			sprite.push_back(new CloudSprite(i, "gray"));
+	}
 
-	cloud[i] = new Cloud(px, py, vx, vy, vapor);
-	cloud[i]->alive = true;
-}
+	// Clouds
+	for(int i = 0; i < s.size; i++) {
+		// Interpolate between the last two ticks
+		sprite[i]->sx = s.ppx[i] + (s.px[i] - s.ppx[i]) * alpha;
+		sprite[i]->sy = s.ppy[i] + (s.py[i] - s.ppy[i]) * alpha;
 
-////////////////////////////////////////////////////////////////////////////////
-// Level functions
-////////////////////////////////////////////////////////////////////////////////
+		if(s.alive[i]) {
+			if(retro) {
+				sprite[i]->draw(s);
+			} else {
+				sprite[i]->show(s);
+			}
 
-void loadLevel(std::string filename) {
-	std::ifstream load(filename.c_str());
-	std::cout << "Loading file: " << filename << std::endl;
+			if(debug) {
+				sprite[i]->drawVapor(s);
+				sprite[i]->drawVelocity(s);
+				sprite[i]->drawPosition(s);
+			}
+		}
 
-	if(!load) {
-		std::cerr << "Error: " << filename << " levelfile not found!" << std::endl;
-		exit(1);
+		if((s.type[i] == human) || (s.type[i] == ai))
+			sprite[i]->drawName(s);
 	}
 
-	while(!load.eof()) {
-		std::string cloudType;
-		float px, py;
-		float vx, vy;
-		float vapor;
+	// Wind
+	if(debug) {
+		if((s.X1 != 0) || (s.Y1 != 0)) {
+			drawLine(screen, s.X1, s.Y1, s.X2, s.Y2, s.color);
 
-		load >> cloudType;
-		load >> px;
-		load >> py;
-		load >> vx;
-		load >> vy;
-		load >> vapor;
+			char windXYs[64] = "WIND(";
+			char *end = formatInt(windXYs + 5, s.X2 - s.X1);
+			strcpy(end, ", ");
+			end = formatInt(end + 2, s.Y2 - s.Y1);
+			strcpy(end, ")");
 
-		if( (cloudType != "") || (px) || (py) || (vx) || (vy) || (vapor) ) {
-			if(cloudType == "THUNDERSTORM") {
-				cloud[thunderCloud] = new Cloud(px, py, vx, vy, vapor);
-				cloud[thunderCloud]->alive = true;
-				++thunderCloud;
-			}
+			smallText.draw(s.X2, s.Y2, windXYs, screen);
+			markDirty(std::min(s.X1, s.X2), std::min(s.Y1, s.Y2), abs(s.X2 - s.X1) + 2, abs(s.Y2 - s.Y1) + 2);
+		}
+	}
 
-			else if(cloudType == "RAINCLOUD") {
-				cloud[rainCloud] = new Cloud(px, py, vx, vy, vapor);
-				cloud[rainCloud]->alive = true;
-				cloud[rainCloud]->type = raincloud;
-				cloud[rainCloud]->color = "gray";
-				++rainCloud;
-			}
+	// Phase times over the last PROFILE_SAMPLES, in microseconds
+	if(debug) {
+		for(int p = 0; p < PHASES; p++) {
+			Uint32 min, avg, p99;
+			phase[p].recent(min, avg, p99);
+
+			char line[128];
+			char *end = line + sprintf(line, "%-10s min ", phaseNames[p]);
+			end = formatFixed(end, min / 1000.0, 1);
+			strcpy(end, " avg ");
+			end = formatFixed(end + 5, avg / 1000.0, 1);
+			strcpy(end, " p99 ");
+			end = formatFixed(end + 5, p99 / 1000.0, 1);
+
+			smallText.draw(10, 10 + p * 12, line, screen);
 		}
 	}
 
-	load.close();
+	trackDirty = false;
+}
+
+// Push the frame to the display, only the changed areas if we can
+void present() {
+	ScopedTimer timer(flipPhase);
+
+	if(fullRedraw || (screen->flags & SDL_DOUBLEBUF)) {
+		SDL_Flip(screen);
+		fullRedraw = false;
+	} else {
+		// What was erased and what was drawn
+		std::vector<SDL_Rect> update(lastRects);
+		update.insert(update.end(), dirtyRects.begin(), dirtyRects.end());
+
+		if(!update.empty())
+			SDL_UpdateRects(screen, update.size(), &update[0]);
+	}
+
+	lastRects.swap(dirtyRects);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -812,10 +4912,14 @@ void loadLevel(std::string filename) {
 ////////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char* argv[]) {
-	gamemodes gamemode;
-
 	std::string player1;
 	std::string player2;
+	std::string tournamentFile;
+	std::string benchmarkFile;
+	bool testing = false;
+	Uint32 seed = time(NULL);
+	Replay replay;
+	Plugin plugins[2];
 
 ////////////////////////////////////////////////////////////////////////////////
 // Commandline Arguments
@@ -825,11 +4929,28 @@ int main(int argc, char* argv[]) {
 		usage();
 	}
 
+	static struct option longOptions[] = {
+		{"headless", no_argument, NULL, 'H'},
+		{"sprite-cache", required_argument, NULL, 'C'},
+		{"pool", required_argument, NULL, 'P'},
+		{"tournament", required_argument, NULL, 'T'},
+		{"results", required_argument, NULL, 'R'},
+		{"record", required_argument, NULL, 'O'},
+		{"replay", required_argument, NULL, 'Y'},
+		{"seek", required_argument, NULL, 'K'},
+		{"seed", required_argument, NULL, 'S'},
+		{"benchmark", required_argument, NULL, 'B'},
+		{"profile", no_argument, NULL, 'G'},
+		{"selftest", no_argument, NULL, 'E'},
+		{NULL, 0, NULL, 0}
+	};
+
 	char opt_char=0;
-	while((opt_char = getopt(argc, argv, "l:vndm:hs:1:2:rfx:y:p:")) != -1) {
+	while((opt_char = getopt_long(argc, argv, "l:vndm:hs:t:1:2:rfx:y:p:", longOptions, NULL)) != -1) {
 		switch(opt_char) {
 			case 'l':
-				loadLevel(optarg);
+				game.loadLevel(optarg);
+				levelFile = optarg;
 				level=true;
 				break;
 			case 'v':
@@ -858,8 +4979,17 @@ int main(int argc, char* argv[]) {
 				limit = atoi(optarg);
 				break;
 
+			case 't':
+				tickRate = atoi(optarg);
+				if(tickRate <= 0) {
+					std::cout << "Error: Tick rate must be positive!" << std::endl;
+					usage();
+				}
+				break;
+
 			case 'd':
 				debug=true;
+				profiling = true;
 				break;
 
 			case '1': {
@@ -869,7 +4999,10 @@ int main(int argc, char* argv[]) {
 					player1 = "AI";
 				else if(player == "human")
 					player1 = "Human";
-				else
+				else if(isPlugin(player)) {
+					player1 = "Plugin";
+					plugins[0].load(player);
+				} else
 					usage();
 
 				std::cout << "Player 1: " << player1 << std::endl;
@@ -883,7 +5016,10 @@ int main(int argc, char* argv[]) {
 					player2 = "AI";
 				else if(player == "human")
 					player2 = "Human";
-				else
+				else if(isPlugin(player)) {
+					player2 = "Plugin";
+					plugins[1].load(player);
+				} else
 					usage();
 
 				std::cout << "Player 2: " << player2 << std::endl;
@@ -913,6 +5049,64 @@ int main(int argc, char* argv[]) {
 				port = atoi(optarg);
 				break;
 
+			case 'H':
+				headless = true;
+				break;
+
+			case 'C':
+				spriteCacheSize = atoi(optarg);
+				break;
+
+			case 'P':
+				poolSize = atoi(optarg);
+
+				// 0 is a thread per core
+				if(poolSize == 0)
+					poolSize = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+
+				if(poolSize < 1) {
+					std::cout << "Error: The pool needs at least one worker thread!" << std::endl;
+					usage();
+				}
+
+				break;
+
+			case 'T':
+				tournamentFile = optarg;
+				break;
+
+			case 'R':
+				resultsFile = optarg;
+				break;
+
+			case 'O':
+				recordFile = optarg;
+				break;
+
+			case 'Y':
+				replayFile = optarg;
+				break;
+
+			case 'K':
+				seekTick = atoi(optarg);
+				break;
+
+			case 'S':
+				seed = strtoul(optarg, NULL, 10);
+				break;
+
+			case 'B':
+				benchmarkFile = optarg;
+				break;
+
+			case 'G':
+				profiling = true;
+				break;
+
+			case 'E':
+				testing = true;
+				break;
+
 			case '?':
 				usage();
 				break;
@@ -923,6 +5117,38 @@ int main(int argc, char* argv[]) {
 		}
 	}
 
+	if(testing)
+		return selftest();
+
+	// Only the simulation, no game
+	if(benchmarkFile != "") {
+		SDL_Init(SDL_INIT_TIMER);
+		selectIntegrate();
+		benchmark(benchmarkFile);
+		profileSummary();
+
+		SDL_Quit();
+		return 0;
+	}
+
+	// A replay brings its own settings, players and world
+	if(replayFile != "") {
+		replay.open(replayFile);
+		game.replay = &replay;
+
+		tickRate = replay.tickRate;
+		width = replay.width;
+		height = replay.height;
+		gamemode = replay.mode;
+		limit = replay.tickLimit / replay.tickRate;
+		seed = replay.seed;
+		level = true;
+
+		player1 = (replay.type[0] == human) ? "Human" : "AI";
+		player2 = (replay.type[1] == human) ? "Human" : "AI";
+		std::cout << "Replay of " << replayFile << ": " << replay.names[0] << " vs " << replay.names[1] << ", " << replay.end << " ticks" << std::endl;
+	}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Game modes
 ////////////////////////////////////////////////////////////////////////////////
@@ -938,6 +5164,9 @@ int main(int argc, char* argv[]) {
 			timeLimit = defaultTimeLimit;
 			std::cout << "Using default time limit: " << timeLimit << std::endl;
 		}
+
+		// The limit is game time, waiting for AIs or a slow box doesn't count
+		tickLimit = timeLimit * tickRate;
 	} else if(gamemode == deathmatch) {
 		std::cout << "Game mode: Deathmatch" << std::endl;
 		title = title + " - Deathmatch";
@@ -945,26 +5174,70 @@ int main(int argc, char* argv[]) {
 
 	title = title + ": " + player1 + " vs " + player2;
 
+	// After the options, it may use the -l level
+	if(tournamentFile != "") {
+		loadTournament(tournamentFile);
+		tournament = true;
+
+		if(poolSize == 0)
+			poolSize = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+
+		std::cout << "Tournament: " << bots.size() << " bots, " << levels.size() << " level(s), " << schedule.size() << " games, " << poolSize << " at a time" << std::endl;
+	}
+
+	// Only the server, the players are whoever connects
+	if(poolSize > 0) {
+		SDL_Init(SDL_INIT_TIMER);
+		selectIntegrate();
+		srand(seed);
+
+		wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		pool.start(poolSize);
+		std::cout << "Running a pool of " << poolSize << " game thread(s)" << std::endl;
+
+		int result = server(NULL);
+		profileSummary();
+		return result;
+	}
+
+	// Nobody can steer a thunderstorm without a window
+	if(headless) {
+		if(((player1 == "Human") || (player2 == "Human")) && !game.replay) {
+			std::cout << "Error: Headless mode needs two AI players!" << std::endl;
+			usage();
+		}
+
+		nosound = true;
+	}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Player setup
 ////////////////////////////////////////////////////////////////////////////////
 
+	std::cout << "Seed: " << seed << std::endl;
+	game.setSeed(seed);
+
 	// Player 1
 	if(player1 == "Human") {
 		if(!level)
-			createCloud(0, vaporStart);
-		cloud[0]->name = "Player 1";
-		cloud[0]->type = human;
-		cloud[0]->player = 1;
-		cloud[0]->color = "blue";
+			game.createCloud(0, human, vaporStart);
+		game.playerNames[0] = "Player 1";
+		game.world.type[0] = human;
+		game.claimed[0] = true;
 		++playerCount;
 	} else if(player1 == "AI") {
 		if(!level)
-			createCloud(0, vaporStart);
-		cloud[0]->name = "AI";
-		cloud[0]->type = ai;
-		cloud[0]->player = 1;
-		cloud[0]->color = "blue";
+			game.createCloud(0, ai, vaporStart);
+		game.playerNames[0] = "AI";
+		game.world.type[0] = ai;
+	} else if(player1 == "Plugin") {
+		if(!level)
+			game.createCloud(0, ai, vaporStart);
+		game.playerNames[0] = plugins[0].name;
+		game.world.type[0] = ai;
+		game.claimed[0] = true;
+		game.plugins[0] = &plugins[0];
+		++playerCount;
 	} else {
 		std::cout << "Error: Player 1 not defined!" << std::endl;
 		usage();
@@ -973,19 +5246,24 @@ int main(int argc, char* argv[]) {
 	// Player 2
 	if(player2 == "Human") {
 		if(!level)
-			createCloud(1, vaporStart);
-		cloud[1]->name = "Player 2";
-		cloud[1]->type = human;
-		cloud[1]->player = 2;
-		cloud[1]->color = "red";
+			game.createCloud(1, human, vaporStart);
+		game.playerNames[1] = "Player 2";
+		game.world.type[1] = human;
+		game.claimed[1] = true;
 		++playerCount;
 	} else if(player2 == "AI") {
 		if(!level)
-			createCloud(1, vaporStart);
-		cloud[1]->name = "AI";
-		cloud[1]->type = ai;
-		cloud[1]->player = 2;
-		cloud[1]->color = "red";
+			game.createCloud(1, ai, vaporStart);
+		game.playerNames[1] = "AI";
+		game.world.type[1] = ai;
+	} else if(player2 == "Plugin") {
+		if(!level)
+			game.createCloud(1, ai, vaporStart);
+		game.playerNames[1] = plugins[1].name;
+		game.world.type[1] = ai;
+		game.claimed[1] = true;
+		game.plugins[1] = &plugins[1];
+		++playerCount;
 	} else {
 		std::cout << "Error: Player 2 not defined!" << std::endl;
 		usage();
@@ -1000,99 +5278,106 @@ int main(int argc, char* argv[]) {
 
 	int sdlFlags;
 	sdlFlags = SDL_SWSURFACE;
-	int time = 0;
 
 	// SDL
-	SDL_Init(SDL_INIT_EVERYTHING);
-
-	if(fullscreen) {
-		sdlFlags |= SDL_FULLSCREEN;
+	if(headless) {
+		// Timer and threads only, no video, audio or fonts
+		SDL_Init(SDL_INIT_TIMER);
+		std::cout << "Running headless!" << std::endl;
 	} else {
-		SDL_putenv((char *)"SDL_VIDEO_CENTERED=center");
-	}
-
-	screen = SDL_SetVideoMode(width, height, bpp, sdlFlags);
-	SDL_WM_SetCaption(title.c_str(), title.c_str());
-
-	//SDL_ShowCursor(0);
-
-	// Audio
-	int audio_rate = 22050;
-	Uint16 audio_format = AUDIO_S16SYS;
-	int audio_channels = 2;
-	int audio_buffers = 4096;
-
-	Mix_OpenAudio(audio_rate, audio_format, audio_channels, audio_buffers);
-
-	// Music and sounds
-	waitingMusic = Mix_LoadMUS("think.mp3");
-	if(!waitingMusic)
-		nosound = true;
-
-	bounceSound = Mix_LoadMUS("bounce.mp3");
-	if(!bounceSound)
-		nosound = true;
-
-	absorbSound = Mix_LoadMUS("absorb.aif");
-	if(!absorbSound)
-		nosound = true;
-
-	music = Mix_LoadWAV("music.wav");
-	if(!music)
-		nosound = true;
+		SDL_Init(SDL_INIT_EVERYTHING);
 
-	winnerSound = Mix_LoadWAV("winner.wav");
-	if(!winnerSound)
-		nosound = true;
+		if(fullscreen) {
+			sdlFlags |= SDL_FULLSCREEN;
+		} else {
+			SDL_putenv((char *)"SDL_VIDEO_CENTERED=center");
+		}
 
-	// Font
-	TTF_Init();
-	font = TTF_OpenFont("LiberationMono-Bold.ttf", 10);
-	fontWinner = TTF_OpenFont("LiberationMono-Bold.ttf", 40);
-	fontWaiting = TTF_OpenFont("LiberationMono-Bold.ttf", 25);
+		screen = SDL_SetVideoMode(width, height, bpp, sdlFlags);
+		SDL_WM_SetCaption(title.c_str(), title.c_str());
+
+		//SDL_ShowCursor(0);
+
+		// Audio
+		int audio_rate = 22050;
+		Uint16 audio_format = AUDIO_S16SYS;
+		int audio_channels = 2;
+		int audio_buffers = 4096;
+
+		Mix_OpenAudio(audio_rate, audio_format, audio_channels, audio_buffers);
+
+		// Music and sounds
+		waitingMusic = Mix_LoadMUS("think.mp3");
+		if(!waitingMusic)
+			nosound = true;
+
+		bounceSound = Mix_LoadMUS("bounce.mp3");
+		if(!bounceSound)
+			nosound = true;
+
+		absorbSound = Mix_LoadMUS("absorb.aif");
+		if(!absorbSound)
+			nosound = true;
+
+		music = Mix_LoadWAV("music.wav");
+		if(!music)
+			nosound = true;
+
+		winnerSound = Mix_LoadWAV("winner.wav");
+		if(!winnerSound)
+			nosound = true;
+
+		// Font
+		TTF_Init();
+		font = TTF_OpenFont("LiberationMono-Bold.ttf", 10);
+		fontWinner = TTF_OpenFont("LiberationMono-Bold.ttf", 40);
+		fontWaiting = TTF_OpenFont("LiberationMono-Bold.ttf", 25);
+		smallText.load(font);
+
+		// Images
+		background = loadImage("sprites/bg.png");
+		blue = loadImage("sprites/blue.png");
+		gray = loadImage("sprites/gray.png");
+		orange = loadImage("sprites/orange.png");
+		purple = loadImage("sprites/purple.png");
+		red = loadImage("sprites/red.png");
+
+		if((!background) || (!blue) || (!gray) || (!orange) || (!purple) || (!red)) {
+			std::cout << "WARNING: Sprite(s) is missing! You can run: ./install_sprites to download the original graphics." << std::endl;
+			retro = true;
+		}
 
-	// Images
-	background = loadImage("sprites/bg.png");
-	blue = loadImage("sprites/blue.png");
-	gray = loadImage("sprites/gray.png");
-	orange = loadImage("sprites/orange.png");
-	purple = loadImage("sprites/purple.png");
-	red = loadImage("sprites/red.png");
+		if(retro)
+			std::cout << "Going retro! (no gfx)" << std::endl;
 
-	if((!background) || (!blue) || (!gray) || (!orange) || (!purple) || (!red)) {
-		std::cout << "WARNING: Sprite(s) is missing! You can run: ./install_sprites to download the original graphics." << std::endl;
-		retro = true;
+		spriteCache.budget = (size_t)spriteCacheSize * 1024 * 1024;
 	}
 
-	if(retro)
-		std::cout << "Going retro! (no gfx)" << std::endl;
-
-	// seed rand
-	srand(SDL_GetTicks());
+	selectIntegrate();
 
 	// init rainclouds randomly
 	if(!level) {
 		for(int i = 2; i < startClouds; i++) {
-			createCloud(i, 0);
-			cloud[i]->type = raincloud;
-			cloud[i]->color = "gray";
+			game.createCloud(i, raincloud, 0);
 		}
-	} else {
-		startClouds = rainCloud;
 	}
 
-	for(int i = startClouds; i < MAX_CLOUDS; i++) {
-		cloud[i] = new Cloud(rand() % width + 1, rand() % height + 1, rand() % 2+1, rand() % 2+1, rand() % 100);
-		cloud[i]->alive = false;
-		cloud[i]->color = "gray";
+	if(game.replay) {
+		game.playerNames[0] = replay.names[0];
+		game.playerNames[1] = replay.names[1];
+		game.seek(seekTick);
 	}
 
+	// Something to show and send before the first tick
+	game.publishSnapshot();
+
 ////////////////////////////////////////////////////////////////////////////////
 // Start server and wait for AIs
 ////////////////////////////////////////////////////////////////////////////////
 
-	if(player1 == "AI" || player2 == "AI") {
+	if((player1 == "AI" || player2 == "AI") && !game.replay) {
 
+		wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 		thread = SDL_CreateThread(server, NULL);
 
 		std::string waitingP1, waitingP2;
@@ -1100,11 +5385,26 @@ int main(int argc, char* argv[]) {
 		waitingP1 = "Waiting on player 1 AI to connect...";
 		waitingP2 = "Waiting on player 2 AI to connect...";
 
+		// The text does not change while waiting, render it once
+		SDL_Surface *waitingLabel1 = NULL;
+		SDL_Surface *waitingLabel2 = NULL;
+
+		if(!headless) {
+			waitingLabel1 = TTF_RenderText_Solid(fontWaiting, waitingP1.c_str(), textColor);
+			waitingLabel2 = TTF_RenderText_Solid(fontWaiting, waitingP2.c_str(), textColor);
+		}
+
 		// Play music loop
 		if(!nosound)
 			Mix_PlayMusic(waitingMusic, -1);
 
 		while(playerCount != 2) {
+			// Nothing to show, just wait for the server thread
+			if(headless) {
+				SDL_Delay(10);
+				continue;
+			}
+
 			while(SDL_PollEvent(&event)) {
 				if(event.type == SDL_QUIT)
 					exit(0);
@@ -1119,22 +5419,21 @@ int main(int argc, char* argv[]) {
 			}
 
 			if((player1 == "AI") && (player2 == "AI")) {
-				winner = TTF_RenderText_Solid(fontWaiting, waitingP1.c_str(), textColor);
-				drawSurface((width/2)-waitingP1.length()*7.5, height/2-20, winner, screen);
-				winner = TTF_RenderText_Solid(fontWaiting, waitingP2.c_str(), textColor);
-				drawSurface((width/2)-waitingP2.length()*7.5, height/2+20, winner, screen);
+				drawSurface((width/2)-waitingP1.length()*7.5, height/2-20, waitingLabel1, screen);
+				drawSurface((width/2)-waitingP2.length()*7.5, height/2+20, waitingLabel2, screen);
 			} else if(player1 == "AI") {
-				winner = TTF_RenderText_Solid(fontWaiting, waitingP1.c_str(), textColor);
-				drawSurface((width/2)-waitingP1.length()*7.5, height/2, winner, screen);
+				drawSurface((width/2)-waitingP1.length()*7.5, height/2, waitingLabel1, screen);
 			} else if(player2 == "AI") {
-				winner = TTF_RenderText_Solid(fontWaiting, waitingP2.c_str(), textColor);
-				drawSurface((width/2)-waitingP2.length()*7.5, height/2, winner, screen);
+				drawSurface((width/2)-waitingP2.length()*7.5, height/2, waitingLabel2, screen);
 			}
 
 			SDL_Flip(screen);
 			SDL_Delay(10);
 		}
 
+		SDL_FreeSurface(waitingLabel1);
+		SDL_FreeSurface(waitingLabel2);
+
 		// stop music
 		if(!nosound)
 			Mix_HaltMusic();
@@ -1145,277 +5444,171 @@ int main(int argc, char* argv[]) {
 ////////////////////////////////////////////////////////////////////////////////
 	std::cout << "Game start!" << std::endl;
 
+	if((recordFile != "") && !game.replay) {
+		if(!game.record(recordFile))
+			exit(1);
+	}
+
+	for(int player = 0; player < 2; player++) {
+		if(game.plugins[player])
+			game.plugins[player]->start(player);
+	}
+
 	// Play music loop
 	if(!nosound) {
 		channel = Mix_PlayChannel(-1, music, -1);
 	}
 
-	while(!done) {
-
-////////////////////////////////////////////////////////////////////////////////
-// Events and Input
-////////////////////////////////////////////////////////////////////////////////
-
-		while(SDL_PollEvent(&event)) {
-			if(event.type == SDL_QUIT)
-				done = true;
+	// Nothing to draw, the simulation gets the main thread
+	if(headless) {
+		Uint32 start = SDL_GetTicks();
+		int first = game.iteration;
 
-			if(event.type == SDL_KEYDOWN) {
-				switch(event.key.keysym.sym) { 
-					case SDLK_ESCAPE:
-						done = true;
-						break;
-				}
-			}
+		simulation(NULL);
 
-			if(event.type == SDL_MOUSEBUTTONDOWN) {
-				if(event.button.button == SDL_BUTTON_LEFT) {
-					int x = event.button.x; 
-					int y = event.button.y;
-					if(player1 == "Human") {
-						int px = x - cloud[0]->px;
-						int py = y - cloud[0]->py;
-						wind(0, px, py);
-					} else if(player2 == "Human") {
-						int px = x - cloud[1]->px;
-						int py = y - cloud[1]->py;
-						wind(1, px, py);
-					}
-				}
-			} 
+		if(game.replay)
+			std::cout << "Replayed " << game.iteration - first << " ticks in " << SDL_GetTicks() - start << " ms" << std::endl;
+	} else
+		simThread = SDL_CreateThread(simulation, NULL);
 
-			// player1 input
-			if(event.type == SDL_KEYDOWN) {
-				switch(event.key.keysym.sym) {
-					case SDLK_UP:
-						wind(0, "up");
-						break;
-					case SDLK_DOWN:
-						wind(0, "down");
-						break;
-					case SDLK_LEFT: 
-						wind(0, "left");
-						break;
-					case SDLK_RIGHT:
-						wind(0, "right");
-						break;
-				}
-			}
+	float msPerTick = 1000.0 / tickRate;
 
-			// player 2 input
-			if(event.type == SDL_KEYDOWN) {
-				switch(event.key.keysym.sym) {
-					case SDLK_w:
-						wind(1, "up");
-						break;
-					case SDLK_s:
-						wind(1, "down");
-						break;
-					case SDLK_a:
-						wind(1, "left");
-						break;
-					case SDLK_d:
-						wind(1, "right");
-						break;
-				}
-			}
-		}
+	while(!game.done) {
 
 ////////////////////////////////////////////////////////////////////////////////
-// Draw
+// Events and Input
 ////////////////////////////////////////////////////////////////////////////////
 
-		// Update title with time if gamemode is timelimit
-		if(gamemode == timelimit) {
-			time = SDL_GetTicks() / 1000;
-
-			std::stringstream ssLimit;
-			ssLimit << timeLimit;
-			std::stringstream ssTime;
-			ssTime << time;
-
-			std::string title2 = title + " - " + ssTime.str() + "/" + ssLimit.str();
-			SDL_WM_SetCaption(title2.c_str(), title2.c_str());
-		}
+		{
+			ScopedTimer timer(eventsPhase);
 
-		// Background
-		if(retro)
-			SDL_FillRect(screen, &screen->clip_rect, SDL_MapRGB(screen->format, 0x00, 0x00, 0x00));
-		else
-			drawSurface(0, 0, background, screen);
+			while(SDL_PollEvent(&event)) {
+				if(event.type == SDL_QUIT)
+					game.done = true;
 
-		// Clouds
-		for(int i = 0; i < MAX_CLOUDS; i++) {
-			if(cloud[i]->alive) {
-				if(retro) {
-					cloud[i]->draw();
-				} else {
-					cloud[i]->show();
-				}
+				// Something else drew over the window
+				if((event.type == SDL_VIDEOEXPOSE) || (event.type == SDL_ACTIVEEVENT))
+					fullRedraw = true;
 
-				if(debug) {
-					cloud[i]->drawVapor();
-					cloud[i]->drawVelocity();
-					cloud[i]->drawPosition();
+				if(event.type == SDL_KEYDOWN) {
+					switch(event.key.keysym.sym) { 
+						case SDLK_ESCAPE:
+							game.done = true;
+							break;
+					}
 				}
-			}
-
-			if((cloud[i]->type == human) || (cloud[i]->type == ai))
-				cloud[i]->drawName();
-		}
-
-		// Wind
-		if(debug) {
-			if((X1 != 0) || (Y1 != 0)) {
-				drawLine(screen, X1, Y1, X2, Y2, COLOR);
 
-				std::stringstream windXYss;
-				windXYss << "WIND(" << X2-X1 << ", " << Y2-Y1 << ")";
-				std::string windXYs = windXYss.str();
+				// Seeking through a replay, 10 seconds at a time
+				if((event.type == SDL_KEYDOWN) && game.replay) {
+					const Snapshot *state = game.snapshots.acquire();
 
-				winner = TTF_RenderText_Solid(font, windXYs.c_str(), textColor);
-				drawSurface(X2, Y2, winner, screen);
-			}
-		}
-
-////////////////////////////////////////////////////////////////////////////////
-// Moving the clouds and checking for collision between boundaries
-////////////////////////////////////////////////////////////////////////////////
-
-		for(int i = 0; i < MAX_CLOUDS; i++) {
-			if(cloud[i]->alive) {
-				bool collision = false;
-
-				// The velocity is damped to make it more natural.
-				cloud[i]->vx *= 0.999;
-				cloud[i]->vy *= 0.999;
+					if(event.key.keysym.sym == SDLK_PAGEUP)
+						seekTo = std::max(0, state->iteration - 10 * tickRate);
+					else if(event.key.keysym.sym == SDLK_PAGEDOWN)
+						seekTo = std::min(replay.end, state->iteration + 10 * tickRate);
 
-				// position += velcoity * 0.1 
-				cloud[i]->px += cloud[i]->vx * 0.1; // left or right
-				cloud[i]->py += cloud[i]->vy * 0.1; //  up or down
-
-				// Collision Left
-				if(cloud[i]->px < cloud[i]->radius()) {
-					cloud[i]->px = cloud[i]->radius();
-					cloud[i]->vx = abs(cloud[i]->vx) * 0.6;
-					collision = true;
-				}
-				
-				// Collision Top
-				if(cloud[i]->py < cloud[i]->radius()) {
-					cloud[i]->py = cloud[i]->radius();
-					cloud[i]->vy = abs(cloud[i]->vy) * 0.6;
-					collision = true;
+					game.snapshots.release(state);
 				}
 
-				// Collision Right
-				if(cloud[i]->px+cloud[i]->radius() > width) {
-					cloud[i]->px = width-cloud[i]->radius();
-					cloud[i]->vx = -abs(cloud[i]->vx) * 0.6;
-					collision = true;
-				}
+				if(event.type == SDL_MOUSEBUTTONDOWN) {
+					if(event.button.button == SDL_BUTTON_LEFT) {
+						int x = event.button.x; 
+						int y = event.button.y;
+
+						// Relative to where the thunderstorm is on the screen
+						const Snapshot *state = game.snapshots.acquire();
+
+						if(player1 == "Human") {
+							int px = x - state->px[0];
+							int py = y - state->py[0];
+							game.queueWind(0, px, py);
+						} else if(player2 == "Human") {
+							int px = x - state->px[1];
+							int py = y - state->py[1];
+							game.queueWind(1, px, py);
+						}
 
-				// Collision Bottom
-				if(cloud[i]->py+cloud[i]->radius() > height) {
-					cloud[i]->py = height-cloud[i]->radius();
-					cloud[i]->vy = -abs(cloud[i]->vy) * 0.6;
-					collision = true;
-				}
+						game.snapshots.release(state);
+					}
+				} 
 
-				// Play sound if collision
-				if(collision) {
-					if(!nosound) {
-						Mix_PlayMusic(bounceSound, 0);
+				// player1 input
+				if(event.type == SDL_KEYDOWN) {
+					switch(event.key.keysym.sym) {
+						case SDLK_UP:
+							game.queueWind(0, "up");
+							break;
+						case SDLK_DOWN:
+							game.queueWind(0, "down");
+							break;
+						case SDLK_LEFT: 
+							game.queueWind(0, "left");
+							break;
+						case SDLK_RIGHT:
+							game.queueWind(0, "right");
+							break;
 					}
 				}
-			}
-		}
 
-////////////////////////////////////////////////////////////////////////////////
-// Collision Testing
-////////////////////////////////////////////////////////////////////////////////
-
-		for(int i = 0; i < MAX_CLOUDS; i++) {
-			if(cloud[i]->alive) {
-				for(int j = 0; j < MAX_CLOUDS; j++) {
-					if(cloud[j]->alive) {
-                        if (i == j) continue;
-						while(checkCollision(*cloud[i], *cloud[j] )) {
-							if(cloud[i]->vapor < cloud[j]->vapor) {
-								cloud[i]->vapor -= absorb;
-								cloud[j]->vapor += absorb;
-							} else if(cloud[i]->vapor > cloud[j]->vapor) {
-								cloud[i]->vapor += absorb;
-								cloud[j]->vapor -= absorb;
-							} else if(cloud[i]->vapor == cloud[j]->vapor) {
-								// random choose between thunderstorms
-								int random = rand() % 2;
-								if(random == 1) {
-									cloud[i]->vapor -= absorb;
-									cloud[j]->vapor += absorb;
-								} else {
-									cloud[i]->vapor += absorb;
-									cloud[j]->vapor -= absorb;
-								}
-							}
-
-							/*
-							// Play sound if collision
-							if(collision) {
-								if(!nosound) {
-									Mix_PlayMusic(absorbSound, 0);
-									std::cout << "play" << std::endl;
-								}
-							}
-							*/
-						}
+				// player 2 input
+				if(event.type == SDL_KEYDOWN) {
+					switch(event.key.keysym.sym) {
+						case SDLK_w:
+							game.queueWind(1, "up");
+							break;
+						case SDLK_s:
+							game.queueWind(1, "down");
+							break;
+						case SDLK_a:
+							game.queueWind(1, "left");
+							break;
+						case SDLK_d:
+							game.queueWind(1, "right");
+							break;
 					}
 				}
-			}
-		}
 
-		for(int i = 2; i < MAX_CLOUDS; i++) {
-			if(cloud[i]->alive) {
-				if(cloud[i]->vapor <= 1.0) {
-					cloud[i]->alive = false;
-				}
 			}
 		}
 
 ////////////////////////////////////////////////////////////////////////////////
-// Endgame
+// Render
 ////////////////////////////////////////////////////////////////////////////////
 
-		if(gamemode == timelimit) {
-			if(time >= timeLimit) {
-				std::cout << "Time's' up!" << std::endl;
-				std::cout << "Player 1 vapor: " << cloud[0]->vapor << std::endl;
-				std::cout << "Player 2 vapor: " << cloud[1]->vapor << std::endl;
-				done = true;
-			}
-		}
+		Uint32 now = SDL_GetTicks();
 
-		if(cloud[0]->vapor <= 1.0) {
-			Winner = 2;
-			done = true;
-		} else if(cloud[1]->vapor <= 1.0) {
-			Winner = 1;
-			done = true;
-		}
+		// The latest tick, never waits for the simulation
+		const Snapshot *state = game.snapshots.acquire();
 
-////////////////////////////////////////////////////////////////////////////////
-// Update
-////////////////////////////////////////////////////////////////////////////////
+		// How far the clock is past that tick
+		float alpha = (now - state->time) / msPerTick;
+		if(alpha > 1)
+			alpha = 1;
 
-		SDL_Flip(screen);
-		SDL_Delay(10);
-		++iteration;
+		render(*state, alpha);
+		game.snapshots.release(state);
+
+		present();
+
+		// Render at the frame rate, the simulation keeps its own pace
+		Uint32 frameTime = SDL_GetTicks() - now;
+		if(frameTime < 1000 / frameRate)
+			SDL_Delay(1000 / frameRate - frameTime);
 	}
 
 ////////////////////////////////////////////////////////////////////////////////
 // Declare winner
 ////////////////////////////////////////////////////////////////////////////////
 
+	// The world is ours again
+	if(simThread)
+		SDL_WaitThread(simThread, NULL);
+
+	game.stopRecording();
+
+	// Let the server see that we are done
+	wakeServer();
+
 	// Stop game music
 	if(!nosound)
 		Mix_HaltChannel(channel);
@@ -1426,71 +5619,74 @@ int main(int argc, char* argv[]) {
 	}
 
 	// Check for winner in timelimit mode or user exiting
-	if(cloud[0]->vapor > cloud[1]->vapor) {
-		Winner = 1;
-		done = true;
-	} else if(cloud[0]->vapor < cloud[1]->vapor) {
-		Winner = 2;
-		done = true;
-	} else if(cloud[0]->vapor == cloud[1]->vapor) {
-		Winner = 0;
-		done = true;
+	game.decideWinner();
+
+	for(int player = 0; player < 2; player++) {
+		if(game.plugins[player])
+			game.plugins[player]->end(game.Winner);
 	}
 
 	std::stringstream winnerSS;
 
-	if(Winner == 0)
+	if(game.Winner == 0)
 		winnerSS << "Draw!";
-	else if(Winner == 1)
-		winnerSS << cloud[0]->name << " (" << player1 << ") wins!";
-	else if(Winner == 2)
-		winnerSS << cloud[1]->name << " (" << player2 << ") wins!";
-	else if(Winner == 3)
-		winnerSS << cloud[2]->name << " (" << player1 << ") wins!";
-	else if(Winner == 4)
-		winnerSS << cloud[3]->name << " (" << player2 << ") wins!";
+	else if(game.Winner == 1)
+		winnerSS << game.playerNames[0] << " (" << player1 << ") wins!";
+	else if(game.Winner == 2)
+		winnerSS << game.playerNames[1] << " (" << player2 << ") wins!";
 
 	std::string winnerS = winnerSS.str();
 	std::cout << winnerS << std::endl;
 
-	winner = TTF_RenderText_Solid(fontWinner, winnerS.c_str(), textColor);
-	drawSurface((width/2)-winnerS.length()*12, height/2, winner, screen);
-	SDL_Flip(screen);
-	SDL_Delay(2000);
+	if(!headless) {
+		winner = TTF_RenderText_Solid(fontWinner, winnerS.c_str(), textColor);
+		drawSurface((width/2)-winnerS.length()*12, height/2, winner, screen);
+		SDL_Flip(screen);
+		SDL_Delay(2000);
+	}
 
 	std::cout << "Game finish!" << std::endl;
+	profileSummary();
 
 ////////////////////////////////////////////////////////////////////////////////
 // Clean up and exit
 ////////////////////////////////////////////////////////////////////////////////
 
-	for(int i = 0; i < MAX_CLOUDS; i++) {
-		delete cloud[i];
+	for(unsigned int i = 0; i < sprite.size(); i++) {
+		delete sprite[i];
 	}
 
-	SDL_FreeSurface(screen);
-
-	SDL_FreeSurface(background);
-	SDL_FreeSurface(blue);
-	SDL_FreeSurface(gray);
-	SDL_FreeSurface(orange);
-	SDL_FreeSurface(purple);
-	SDL_FreeSurface(red);
-
-	Mix_FreeMusic(waitingMusic);
-	Mix_FreeMusic(bounceSound);
-	Mix_FreeMusic(absorbSound);
-	Mix_FreeChunk(music);
-	Mix_FreeChunk(winnerSound);
-	Mix_CloseAudio();
+	if(!headless) {
+		spriteCache.clear();
+		smallText.clear();
+		SDL_FreeSurface(screen);
+
+		SDL_FreeSurface(background);
+		SDL_FreeSurface(blue);
+		SDL_FreeSurface(gray);
+		SDL_FreeSurface(orange);
+		SDL_FreeSurface(purple);
+		SDL_FreeSurface(red);
+
+		Mix_FreeMusic(waitingMusic);
+		Mix_FreeMusic(bounceSound);
+		Mix_FreeMusic(absorbSound);
+		Mix_FreeChunk(music);
+		Mix_FreeChunk(winnerSound);
+		Mix_CloseAudio();
+
+		SDL_FreeSurface(winner);
+		TTF_CloseFont(font);
+		TTF_CloseFont(fontWinner);
+		TTF_CloseFont(fontWaiting);
+		TTF_Quit();
+	}
 
-	SDL_FreeSurface(winner);
-	TTF_CloseFont(font);
-	TTF_CloseFont(fontWinner);
-	TTF_CloseFont(fontWaiting);
-	TTF_Quit(); 
+	if(thread)
+		SDL_WaitThread(thread, NULL);
 
-	SDL_KillThread(thread);
+	if(wakeFd >= 0)
+		close(wakeFd);
 
 	SDL_Quit();
 	return 0;
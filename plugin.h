@@ -0,0 +1,49 @@
+#ifndef CLOUDWARSX_PLUGIN_H
+#define CLOUDWARSX_PLUGIN_H
+
+// A bot can be a shared library instead of a client. The game loads it with
+// "-1 mybot.so" or "-2 mybot.so" and calls it from the simulation before
+// every tick, without a socket in between. Build it with
+//   g++ -O2 -shared -fPIC -I<cloudwarsx> mybot.cpp -o mybot.so
+// and export the functions at the bottom with extern "C". See
+// ai-clients/cpp/chaser.cpp for one.
+
+const int PLUGIN_VERSION = 1;
+
+// The world as the tick sees it, only valid during on_tick(). Cloud i is
+// index i of every array, 0 and 1 are the thunderstorms, and a slot only
+// holds a cloud while alive[i] is set.
+struct WorldView {
+	int version; // PLUGIN_VERSION of the game
+	int iteration;
+	int you; // 0 or 1, the thunderstorm the plugin steers
+	int width, height;
+	int tickRate;
+	int size; // number of slots
+
+	const float *px, *py;
+	const float *vx, *vy;
+	const float *vapor;
+	const float *radius;
+	const unsigned char *alive;
+};
+
+// A WIND, the same as the command of a client
+struct Wind {
+	int x, y;
+};
+
+extern "C" {
+	// Once before the first tick. Whatever it returns is passed to on_tick()
+	// and on_end(), so one library can play both players.
+	void *on_start(int you);
+
+	// Before every tick. Write up to max WINDs to winds and return how many,
+	// they are applied by the tick like those of a client.
+	int on_tick(void *context, const WorldView &world, Wind *winds, int max);
+
+	// After the last tick, winner is 0 for a draw, else 1 or 2. Optional.
+	void on_end(void *context, int winner);
+}
+
+#endif
@@ -0,0 +1,405 @@
+// Load generator for the game server. Opens many connections to a local
+// cloudwarsx, sends NAME, waits for START and then sends GET_STATE and WIND
+// at a rate and pipeline depth of your choice, timing every reply.
+//
+// The window game only takes two clients, so run the server with --pool:
+//   ./cloudwarsx --pool 0 -m timelimit -s 600 &
+//   ./loadgen -c 200 -q 4 -s 10
+//
+// The WINDs are "WIND 0 0": too weak to be applied, but they still wait for
+// the next tick like any other WIND, so the games do not change under load.
+// A client whose game ends is connected again.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Config
+////////////////////////////////////////////////////////////////////////////////
+int port = 1986;
+int connections = 100;
+double rate = 0; // requests a second per connection, 0 is as fast as the replies come
+int depth = 1; // requests in flight per connection
+int windPercent = 10;
+double seconds = 10;
+int bits = 0; // BINARY 32 or 16, 0 for the text state
+
+const int MAX_EVENTS = 256;
+const int BUCKETS = 32; // histogram buckets, powers of two microseconds
+
+////////////////////////////////////////////////////////////////////////////////
+// Clock
+////////////////////////////////////////////////////////////////////////////////
+
+double now() {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Latencies
+////////////////////////////////////////////////////////////////////////////////
+
+enum kinds {
+	getState,
+	wind
+};
+
+const char *kindNames[] = {"GET_STATE", "WIND"};
+
+// Every reply time of one kind, in microseconds
+class Latencies {
+	public:
+		void add(double us) { samples.push_back(us); }
+		void report(double elapsed);
+
+		std::vector<float> samples;
+};
+
+void Latencies::report(double elapsed) {
+	std::sort(samples.begin(), samples.end());
+	size_t n = samples.size();
+
+	if(n == 0) {
+		std::cout << "0 replies" << std::endl;
+		return;
+	}
+
+	std::cout << n << " replies, " << (long)(n / elapsed) << "/s"
+		<< ", p50 " << samples[n / 2] << " us"
+		<< ", p99 " << samples[n * 99 / 100] << " us"
+		<< ", p999 " << samples[n * 999 / 1000] << " us"
+		<< ", max " << samples[n - 1] << " us" << std::endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Connections
+////////////////////////////////////////////////////////////////////////////////
+
+enum stages {
+	waitingStart, // sent NAME
+	waitingBinary, // sent BINARY
+	playing
+};
+
+class Request {
+	public:
+		kinds kind;
+		double sent;
+};
+
+class Connection {
+	public:
+		int fd;
+		int number;
+		stages stage;
+		std::string in; // received and not handled yet
+		std::string out; // not written yet
+		std::deque<Request> inFlight;
+		double next; // when the next request is due with a rate
+};
+
+std::vector<Connection> connection;
+Latencies latencies[2];
+long long received = 0;
+int reconnects = 0;
+int poller;
+
+void sendTo(Connection &c, const char *data) {
+	c.out += data;
+
+	ssize_t n = write(c.fd, c.out.data(), c.out.size());
+	if(n > 0)
+		c.out.erase(0, n);
+
+	// The rest goes when the socket has room
+	epoll_event event;
+	event.events = EPOLLIN;
+	if(!c.out.empty())
+		event.events |= EPOLLOUT;
+	event.data.u32 = c.number;
+	epoll_ctl(poller, EPOLL_CTL_MOD, c.fd, &event);
+}
+
+void connectClient(Connection &c) {
+	c.fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if(connect(c.fd, (sockaddr *)&address, sizeof(address)) < 0) {
+		std::cout << "Error: Could not connect to port " << port << ": " << strerror(errno) << std::endl;
+		exit(1);
+	}
+
+	int one = 1;
+	setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL) | O_NONBLOCK);
+
+	epoll_event event;
+	event.events = EPOLLIN;
+	event.data.u32 = c.number;
+	epoll_ctl(poller, EPOLL_CTL_ADD, c.fd, &event);
+
+	c.stage = waitingStart;
+	c.in.clear();
+	c.out.clear();
+	c.inFlight.clear();
+
+	char name[32];
+	sprintf(name, "NAME load%d\n", c.number);
+	sendTo(c, name);
+}
+
+void disconnect(Connection &c) {
+	close(c.fd);
+	c.fd = -1;
+}
+
+// Send requests until the pipeline is full, or the rate says wait
+void sendRequests(Connection &c, double time) {
+	while((c.stage == playing) && ((int)c.inFlight.size() < depth)) {
+		if(rate > 0) {
+			if(time < c.next)
+				return;
+
+			c.next = std::max(c.next + 1 / rate, time - 1 / rate);
+		}
+
+		Request request;
+		request.kind = (rand() % 100 < windPercent) ? wind : getState;
+		request.sent = time;
+		c.inFlight.push_back(request);
+
+		sendTo(c, request.kind == wind ? "WIND 0 0\n" : "GET_STATE\n");
+	}
+}
+
+// Bytes of the first reply in c.in, 0 while it is not all here
+size_t replyLength(Connection &c) {
+	if((c.stage != playing) || c.inFlight.empty()) {
+		size_t end = c.in.find('\n');
+		return end == std::string::npos ? 0 : end + 1;
+	}
+
+	// OK or IGNORE, also to a GET_STATE when our game is not there yet
+	if((c.inFlight.front().kind == wind) || (c.in[0] == 'I')) {
+		size_t end = c.in.find('\n');
+		return end == std::string::npos ? 0 : end + 1;
+	}
+
+	if(bits) {
+		// The length is in the header
+		if(c.in.size() < 8)
+			return 0;
+
+		const unsigned char *b = (const unsigned char *)c.in.data() + 4;
+		size_t length = b[0] | (b[1] << 8) | (b[2] << 16) | ((size_t)b[3] << 24);
+		return c.in.size() < length ? 0 : length;
+	}
+
+	size_t end = c.in.find("END_STATE\n");
+	return end == std::string::npos ? 0 : end + 10;
+}
+
+void handleReply(Connection &c, const std::string &reply, double time) {
+	if(c.stage == waitingStart) {
+		if(reply == "START\n") {
+			if(bits) {
+				char binary[32];
+				sprintf(binary, "BINARY %d\n", bits);
+				c.stage = waitingBinary;
+				sendTo(c, binary);
+			} else {
+				c.stage = playing;
+				c.next = time;
+			}
+		}
+	} else if(c.stage == waitingBinary) {
+		c.stage = playing;
+		c.next = time;
+	} else if(!c.inFlight.empty()) {
+		Request request = c.inFlight.front();
+		c.inFlight.pop_front();
+		latencies[request.kind].add((time - request.sent) * 1e6);
+	}
+}
+
+void readReplies(Connection &c, double time) {
+	char buffer[65536];
+	ssize_t n;
+
+	while((n = read(c.fd, buffer, sizeof(buffer))) > 0) {
+		c.in.append(buffer, n);
+		received += n;
+	}
+
+	// Disconnected, our game is over
+	if((n == 0) || ((n < 0) && (errno != EAGAIN))) {
+		disconnect(c);
+		connectClient(c);
+		++reconnects;
+		return;
+	}
+
+	size_t length;
+
+	while((length = replyLength(c)) > 0) {
+		handleReply(c, c.in.substr(0, length), time);
+		c.in.erase(0, length);
+	}
+
+	sendRequests(c, time);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Main
+////////////////////////////////////////////////////////////////////////////////
+
+void usage() {
+	std::cout << "Usage: ./loadgen -c connections -q depth -r rate -s seconds" << std::endl;
+	std::cout << "\t-p port\t\tport of the local server (1986)" << std::endl;
+	std::cout << "\t-c connections\tclients to open (100)" << std::endl;
+	std::cout << "\t-r rate\t\trequests a second per client, 0 as fast as the replies come (0)" << std::endl;
+	std::cout << "\t-q depth\trequests in flight per client (1)" << std::endl;
+	std::cout << "\t-w percent\tof the requests that are WIND (10)" << std::endl;
+	std::cout << "\t-s seconds\thow long to run (10)" << std::endl;
+	std::cout << "\t-b bits\t\tBINARY 32 or 16 state, text without" << std::endl;
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	int opt;
+
+	while((opt = getopt(argc, argv, "p:c:r:q:w:s:b:h")) != -1) {
+		switch(opt) {
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'c':
+				connections = atoi(optarg);
+				break;
+			case 'r':
+				rate = atof(optarg);
+				break;
+			case 'q':
+				depth = atoi(optarg);
+				break;
+			case 'w':
+				windPercent = atoi(optarg);
+				break;
+			case 's':
+				seconds = atof(optarg);
+				break;
+			case 'b':
+				bits = atoi(optarg);
+				break;
+			default:
+				usage();
+				break;
+		}
+	}
+
+	if((connections < 1) || (depth < 1) || (rate < 0) || ((bits != 0) && (bits != 32) && (bits != 16)))
+		usage();
+
+	std::cout << connections << " clients, " << depth << " in flight each, ";
+	if(rate > 0)
+		std::cout << rate << " requests/s each, ";
+	std::cout << windPercent << "% WIND, " << (bits ? "binary" : "text") << " state" << std::endl;
+
+	poller = epoll_create1(0);
+	connection.resize(connections);
+
+	for(int i = 0; i < connections; i++) {
+		connection[i].number = i;
+		connectClient(connection[i]);
+	}
+
+	double start = now();
+	double end = start + seconds;
+	epoll_event events[MAX_EVENTS];
+
+	while(now() < end) {
+		// With a rate, wake up every millisecond to send what is due
+		int n = epoll_wait(poller, events, MAX_EVENTS, rate > 0 ? 1 : 100);
+		double time = now();
+
+		for(int i = 0; i < n; i++) {
+			Connection &c = connection[events[i].data.u32];
+
+			if(events[i].events & EPOLLOUT)
+				sendTo(c, "");
+
+			if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				readReplies(c, time);
+		}
+
+		if(rate > 0) {
+			for(int i = 0; i < connections; i++)
+				sendRequests(connection[i], time);
+		}
+	}
+
+	double elapsed = now() - start;
+
+	int waiting = 0;
+	for(int i = 0; i < connections; i++) {
+		if(connection[i].stage != playing)
+			++waiting;
+
+		disconnect(connection[i]);
+	}
+
+	std::cout << "Ran " << elapsed << " s, " << reconnects << " reconnect(s), " << waiting << " client(s) never started" << std::endl;
+
+	Latencies all;
+	for(int kind = 0; kind < 2; kind++) {
+		std::cout << kindNames[kind] << ": ";
+		latencies[kind].report(elapsed);
+		all.samples.insert(all.samples.end(), latencies[kind].samples.begin(), latencies[kind].samples.end());
+	}
+
+	std::cout << "All: ";
+	all.report(elapsed);
+	std::cout << "Received " << received / 1048576.0 / elapsed << " MB/s" << std::endl;
+
+	// Replies by time, the bucket is up to that many microseconds
+	long long histogram[BUCKETS] = {0};
+
+	for(size_t i = 0; i < all.samples.size(); i++) {
+		int bucket = 0;
+		while((bucket < BUCKETS - 1) && (all.samples[i] > (1LL << bucket)))
+			++bucket;
+
+		++histogram[bucket];
+	}
+
+	std::cout << "us\treplies" << std::endl;
+	for(int bucket = 0; bucket < BUCKETS; bucket++) {
+		if(histogram[bucket])
+			std::cout << (1LL << bucket) << "\t" << histogram[bucket] << std::endl;
+	}
+
+	return 0;
+}